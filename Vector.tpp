@@ -145,7 +145,7 @@ double Vector<S, type>::distance(const Vector<S, type>& rhs) const {
   double ret = 0;
 
   for(auto l = begin(), r = rhs.begin(); l != end(); l++, r++) {
-    ret += pow(*l - *r, 2);
+    ret += (*l - *r)*(*l - *r);
   }
 
   return sqrt(ret);
@@ -179,7 +179,7 @@ double Vector<S, type>::length() const {
   double ret = 0;
 
   for(auto iter = begin(); iter != end(); iter++) {
-    ret += pow(*iter, 2);
+    ret += (*iter)*(*iter);
   }
 
   return sqrt(ret);
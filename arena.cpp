@@ -0,0 +1,109 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <arena.h>
+
+#include <cstdint>
+#include <sys/mman.h>
+
+#define HUGE_PAGE (2 << 20)
+
+/**
+ * Creates an empty arena, no memory is taken until the first allocation.
+ *
+ * @param block the size of the blocks taken from the system
+ */
+arena::arena(size_t block) :
+    _cur(NULL), _end(NULL), _blocks(NULL), _finalizers(NULL), _block(block),
+    _used(0), _mapped(0), _huge(0), _n_blocks(0) { }
+
+/**
+ * Hands out memory from the current block, taking a new block if the current
+ * one is too full.
+ *
+ * @param bytes the number of bytes needed
+ * @param align the alignment of the memory, a power of two
+ * @return the memory
+ */
+void* arena::allocate(size_t bytes, size_t align) {
+  uintptr_t p = (uintptr_t(_cur) + align - 1) & ~uintptr_t(align - 1);
+
+  if(_cur == NULL || p + bytes > uintptr_t(_end)) {
+    grow(bytes + align);
+    p = (uintptr_t(_cur) + align - 1) & ~uintptr_t(align - 1);
+  }
+
+  _cur = (char*)(p + bytes);
+  _used += bytes;
+  return (void*)p;
+}
+
+/**
+ * Takes a new block from the system. Explicit huge pages are tried first,
+ * then the kernel is asked to back a normal mapping with transparent huge
+ * pages. Blocks are rounded up to a whole number of huge pages.
+ *
+ * @param bytes the least number of bytes the block has to hold
+ */
+void arena::grow(size_t bytes) {
+  size_t size = bytes + sizeof(block) > _block ? bytes + sizeof(block) : _block;
+  void* mem = MAP_FAILED;
+  bool huge = false;
+
+  size = (size + HUGE_PAGE - 1) & ~size_t(HUGE_PAGE - 1);
+
+#ifdef MAP_HUGETLB
+  mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  huge = mem != MAP_FAILED;
+#endif
+  if(mem == MAP_FAILED) {
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+  }
+
+  block* b = static_cast<block*>(mem);
+  b->next = _blocks;
+  b->size = size;
+  _blocks = b;
+
+  _cur = (char*)mem + sizeof(block);
+  _end = (char*)mem + size;
+  _mapped += size;
+  _huge += huge ? size : 0;
+  _n_blocks++;
+}
+
+/**
+ * Runs the destructors of the objects made with create() and gives every
+ * block back to the system. The arena can be used again afterwards.
+ */
+void arena::release() {
+  for(finalizer* f = _finalizers; f != NULL; f = f->next) {
+    f->destroy(f->ptr);
+  }
+
+  for(block* b = _blocks; b != NULL;) {
+    block* next = b->next;
+    munmap(b, b->size);
+    b = next;
+  }
+
+  _cur = _end = NULL;
+  _blocks = NULL;
+  _finalizers = NULL;
+  _used = _mapped = _huge = 0;
+  _n_blocks = 0;
+}
@@ -0,0 +1,124 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef ARENA_H_INCLUDE
+#define ARENA_H_INCLUDE
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Bump allocator for everything that is built while reading a scene. Memory
+ * is taken from the system in large blocks, backed by huge pages where the
+ * system has them, and handed out by moving a pointer. Nothing is freed one
+ * object at a time, release() returns every block at once.
+ *
+ * Objects made with create() that own memory outside of the arena have their
+ * destructor run by release(), in the reverse of the order they were made.
+ * Objects made with make() never have their destructor run, so make() is only
+ * for types whose destructor does nothing.
+ *
+ * @file arena.h
+ */
+class arena {
+  public:
+
+    arena(size_t block = BLOCK_SIZE);
+    virtual ~arena() { release(); }
+
+    void* allocate(size_t bytes, size_t align = alignof(std::max_align_t));
+    void release();
+
+    template<typename T, typename... Args>
+    T* create(Args&&... args);
+    template<typename T, typename... Args>
+    T* make(Args&&... args);
+
+    inline size_t used() const { return _used; }
+    inline size_t mapped() const { return _mapped; }
+    inline size_t huge() const { return _huge; }
+    inline int blocks() const { return _n_blocks; }
+
+    static const size_t BLOCK_SIZE = 2 << 20;
+
+  protected:
+
+    /** header at the start of every block taken from the system */
+    struct block {
+      block* next;
+      size_t size;
+    };
+
+    /** a destructor that release() has to run */
+    struct finalizer {
+      finalizer* next;
+      void (*destroy)(void*);
+      void* ptr;
+    };
+
+    template<typename T>
+    static void destroy(void* ptr) { static_cast<T*>(ptr)->~T(); }
+
+    void grow(size_t bytes);
+
+    char*      _cur;         ///< next free byte in the current block
+    char*      _end;         ///< end of the current block
+    block*     _blocks;      ///< every block, newest first
+    finalizer* _finalizers;  ///< destructors to run, newest first
+    size_t     _block;       ///< the size of a normal block
+    size_t     _used;        ///< bytes handed out
+    size_t     _mapped;      ///< bytes taken from the system
+    size_t     _huge;        ///< bytes that are backed by explicit huge pages
+    int        _n_blocks;    ///< number of blocks taken from the system
+
+  private:
+
+    arena(const arena&);
+    arena& operator=(const arena&);
+};
+
+/**
+ * Constructs an object in the arena. If the object has a destructor it will be
+ * run when the arena is released.
+ *
+ * @param args the arguments to the constructor
+ * @return the new object
+ */
+template<typename T, typename... Args>
+T* arena::create(Args&&... args) {
+  T* ret = make<T>(std::forward<Args>(args)...);
+
+  if(!std::is_trivially_destructible<T>::value) {
+    finalizer* f = static_cast<finalizer*>(allocate(sizeof(finalizer), alignof(finalizer)));
+    f->next = _finalizers;
+    f->destroy = &destroy<T>;
+    f->ptr = ret;
+    _finalizers = f;
+  }
+
+  return ret;
+}
+
+/**
+ * Constructs an object in the arena that is never destroyed, its memory is
+ * simply reused once the arena is released.
+ *
+ * @param args the arguments to the constructor
+ * @return the new object
+ */
+template<typename T, typename... Args>
+T* arena::make(Args&&... args) {
+  return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+}
+
+#endif /* ARENA_H_INCLUDE */
@@ -0,0 +1,237 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <batch.h>
+#include <pool.h>
+#include <trace.h>
+
+#include <algorithm>
+using std::max;
+#include <iostream>
+using std::cout;
+using std::endl;
+#include <sstream>
+
+#include <cv.h>
+#include <highgui.h>
+
+/* intialize statics */
+int batch::scenes = 4;
+int batch::ahead  = 2;
+
+/**
+ * Creates a batch, nothing is read until run() is called.
+ *
+ * @param read the function that reads a scene file
+ * @param files the scene files, rendered in this order
+ */
+batch::batch(reader read, const vector<string>& files) :
+    _read(read), _files(files), _names(names(files)), _parsed(), _done(), _tracing(), _read_all(false),
+    _traced_all(false), _most(0), _written(0), _parse(0), _encode(0) { }
+
+/**
+ * Picks the image file of each scene, the name of the scene file without its
+ * directory or extension. Names that more than one scene would get have the
+ * place of the scene in the list added, counting from 1.
+ *
+ * @param files the scene files
+ * @return the image file of each scene, in the same order
+ */
+vector<string> batch::names(const vector<string>& files) {
+  vector<string> ret;
+  for(auto iter = files.begin(); iter != files.end(); iter++) {
+    string name = iter->substr(iter->find_last_of('/') + 1);
+    ret.push_back(name.substr(0, name.find_last_of('.')));
+  }
+
+  vector<string> out;
+  for(unsigned int i = 0; i < ret.size(); i++) {
+    std::ostringstream name;
+    name << ret[i];
+    if(std::count(ret.begin(), ret.end(), ret[i]) > 1) {
+      name << "_" << i + 1;
+    }
+    name << ".png";
+    out.push_back(name.str());
+  }
+
+  return out;
+}
+
+/**
+ * Renders every scene of the batch. The calling thread hands parsed scenes
+ * to the workers, at most scenes of them at once, and returns once every
+ * image has been written.
+ */
+void batch::run() {
+  long long start = trace::now();
+  trace::thread_name("main");
+
+  /* one time budget for the whole batch, see batch.h */
+  ray::begin();
+#ifndef DEBUG
+  ray::rays.open();
+  pool::workers().start(ray::work);
+#endif
+
+  std::thread parser(&batch::parse_all, this);
+  std::thread encoder(&batch::encode_all, this);
+
+  for(;;) {
+    job* j;
+
+    {
+      std::unique_lock<std::mutex> ul(_lock);
+      long long wait = trace::enabled ? trace::now() : 0;
+      while(_parsed.empty() && !_read_all) {
+        _ready.wait(ul);
+      }
+      if(_parsed.empty()) {
+        break;
+      }
+      while(int(_tracing.size()) >= max(scenes, 1) || int(_done.size()) >= max(scenes, 1)) {
+        _room.wait(ul);
+      }
+      if(trace::enabled) trace::record("batch wait", wait);
+
+      j = _parsed.front();
+      _parsed.pop_front();
+      _tracing[j->b] = j;
+      _most = max(_most, (unsigned int)_tracing.size());
+      _ready.notify_all();
+    }
+
+    /* the band may finish, and the job be written, before this returns */
+    j->c->generate(j->m, j->b);
+  }
+
+#ifndef DEBUG
+  ray::rays.close();
+  pool::workers().wait();
+#endif
+
+  {
+    std::unique_lock<std::mutex> ul(_lock);
+    _traced_all = true;
+    _work.notify_one();
+  }
+  parser.join();
+  encoder.join();
+
+  double ms = (trace::now() - start) / 1e6;
+  cout << "batch: " << _written << " of " << _files.size() << " scenes in " << ms << " ms ("
+       << _written / (ms / 1000) << " scenes/s)" << endl;
+  if(model::stats) {
+    cout << "batch: parse " << _parse / 1e6 << " ms, encode " << _encode / 1e6 << " ms, at most "
+         << _most << " scenes traced at once" << endl;
+  }
+}
+
+/**
+ * Called by the last ray of a scene, queues the scene to be written.
+ *
+ * @param b the frame of the scene
+ */
+void batch::finish(image_band* b) {
+  std::unique_lock<std::mutex> ul(_lock);
+  auto iter = _tracing.find(b);
+
+  _done.push_back(iter->second);
+  _tracing.erase(iter);
+  _room.notify_one();
+  _work.notify_one();
+}
+
+/**
+ * The parser thread, reads the scenes in order while staying at most ahead
+ * scenes in front of the tracer. Scenes that cannot be read are skipped.
+ */
+void batch::parse_all() {
+  trace::thread_name("parser");
+
+  for(unsigned int i = 0; i < _files.size(); i++) {
+    long long start = trace::now();
+    pair<model*, camera*> p = _read(_files[i].c_str());
+    long long end = trace::now();
+    if(trace::enabled) trace::record("parse", start, i);
+
+    if(p.first == NULL || p.second == NULL) {
+      delete p.first;
+      delete p.second;
+      continue;
+    }
+
+    const camera* c = p.second;
+    job* j = new job;
+    j->name = _names[i];
+    j->m    = p.first;
+    j->c    = p.second;
+    j->b    = new image_band(this, 0, c->vmax() - c->vmin() + 1, c->umax() - c->umin() + 1);
+
+    std::unique_lock<std::mutex> ul(_lock);
+    _parse += end - start;
+    while(int(_parsed.size()) >= max(ahead, 1)) {
+      _ready.wait(ul);
+    }
+    _parsed.push_back(j);
+    _ready.notify_all();
+  }
+
+  std::unique_lock<std::mutex> ul(_lock);
+  _read_all = true;
+  _ready.notify_all();
+}
+
+/**
+ * The encoder thread, writes each scene once it has been traced and frees it.
+ */
+void batch::encode_all() {
+  trace::thread_name("encoder");
+
+  for(;;) {
+    job* j;
+
+    {
+      std::unique_lock<std::mutex> ul(_lock);
+      while(_done.empty() && !_traced_all) {
+        _work.wait(ul);
+      }
+      if(_done.empty()) {
+        return;
+      }
+      j = _done.front();
+      _done.pop_front();
+      _room.notify_one();
+    }
+
+    long long start = trace::now();
+    {
+      trace_span span("encode", _written);
+      const image_band* b = j->b;
+      cv::Mat image(b->rows, b->width, CV_8UC3);
+      for(int y = 0; y < b->rows; y++) {
+        for(int x = 0; x < b->width; x++) {
+          image.at<Vector<3, uc> >(y, x) = b->pixels[y * b->width + x];
+        }
+      }
+      cv::imwrite(j->name, image);
+
+      delete j->m;
+      delete j->c;
+      delete j->b;
+      delete j;
+    }
+
+    std::unique_lock<std::mutex> ul(_lock);
+    _encode += trace::now() - start;
+    _written++;
+  }
+}
@@ -0,0 +1,99 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef BATCH_H_INCLUDE
+#define BATCH_H_INCLUDE
+
+#include <camera.h>
+#include <image_writer.h>
+#include <model.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+using std::string;
+#include <thread>
+#include <utility>
+using std::pair;
+#include <vector>
+using std::vector;
+
+/**
+ * Renders a list of scenes as a pipeline instead of one after the other. A
+ * parser thread reads and builds the scenes ahead of the tracer, the rays of
+ * several scenes share one pool of workers and the queue, and an encoder
+ * thread writes and frees each scene as soon as its last ray finishes. While
+ * one scene is being written the next is traced and the one after is parsed,
+ * so small scenes do not leave the workers idle between frames.
+ *
+ * Each scene is written to a png named after its file, without the directory,
+ * in the working directory. Scenes whose files have the same name in different
+ * directories have their place in the list added, "sphere_3.png", so that one
+ * does not write over the other. Nothing is displayed.
+ *
+ * The scenes share the queue, so ray::time_budget is one clock for the whole
+ * batch and not for each scene: it starts when run() does, and every scene
+ * still being traced when it runs out keeps what it has.
+ *
+ * @file batch.h
+ */
+class batch : public band_sink {
+  public:
+
+    /** reads a scene file, both NULL if it could not be read */
+    typedef pair<model*, camera*> (*reader)(const char*);
+
+    batch(reader read, const vector<string>& files);
+    virtual ~batch() { }
+
+    void run();
+    virtual void finish(image_band* b);
+
+    static int scenes;
+    static int ahead;
+
+  protected:
+
+    /** a scene making its way through the pipeline */
+    struct job {
+      string      name;   ///< the image file to write
+      model*      m;      ///< the scene
+      camera*     c;      ///< the camera of the scene
+      image_band* b;      ///< the whole frame
+    };
+
+    static vector<string> names(const vector<string>& files);
+    void parse_all();
+    void encode_all();
+
+    reader         _read;   ///< how scene files are read
+    vector<string> _files;  ///< the scene files in order
+    vector<string> _names;  ///< the image file of each scene
+
+    std::mutex                   _lock;      ///< protects everything below
+    std::condition_variable      _ready;     ///< a scene was parsed or taken from _parsed
+    std::condition_variable      _room;      ///< a scene finished tracing or was written
+    std::condition_variable      _work;      ///< signals the encoder
+    std::deque<job*>             _parsed;    ///< scenes waiting to be traced
+    std::deque<job*>             _done;      ///< scenes waiting to be written
+    std::map<image_band*, job*>  _tracing;   ///< scenes whose rays are in the queue
+    bool                         _read_all;  ///< the parser has finished
+    bool                         _traced_all;///< every scene has been traced
+
+    unsigned int _most;     ///< most scenes that were traced at once
+    int          _written;  ///< scenes written
+    long long    _parse;    ///< time spent parsing in ns
+    long long    _encode;   ///< time spent writing in ns
+};
+
+#endif /* BATCH_H_INCLUDE */
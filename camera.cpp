@@ -10,22 +10,35 @@
  **************************************************************************** */
 
 #include <camera.h>
+#include <checkpoint.h>
+#include <denoiser.h>
+#include <display.h>
+#include <fastmath.h>
 #include <lexer.h>
+#include <pool.h>
+#include <raster.h>
+#include <shadow_cache.h>
+#include <trace.h>
 
 #include <algorithm>
 using std::for_each;
 using std::min;
 using std::max;
+#include <atomic>
 #include <boost/bind.hpp>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <exception>
 using std::exception;
 #include <iostream>
+using std::cerr;
 using std::cout;
 using std::endl;
 using std::flush;
 #include <limits>
 using std::numeric_limits;
+#include <mutex>
 #include <sstream>
 using std::ostringstream;
 #include <string>
@@ -34,6 +47,9 @@ using std::string;
 #include <tuple>
 using std::tuple;
 using std::get;
+#include <unistd.h>
+#include <vector>
+using std::vector;
 
 #include <cv.h>
 #include <cvaux.h>
@@ -41,44 +57,160 @@ using std::get;
 #include <highgui.h>
 
 #define MAX_DEPTH 700
+#define MAX_DEFERRALS 8
 #define X_PRINT 0
 #define Y_PRINT 0
 
 /* intialize statics */
+bool   gbuffer::enabled = false;
+int        ray::budget      = 1024;
+double     ray::roulette    = 0.05;
+ray::order ray::schedule    = ray::banded;
+double     ray::time_budget = 0;
+
+static std::atomic<unsigned long> branches(0);  ///< branches split off of rays
+static std::atomic<unsigned long> killed(0);    ///< branches ended by russian roulette
+static std::atomic<unsigned long> cut(0);       ///< ray trees that ran out of budget
+static std::atomic<unsigned long> late(0);      ///< pixels ended by the time budget
+static long long                  deadline = 0; ///< when the render runs out of time, 0 for never
+static checkpoint*                saving = NULL;///< where finished pixels are saved, NULL if they are not
+
+/**
+ * Fills in a pixel that was finished before the render was resumed, see
+ * checkpoint.
+ *
+ * @param b the band of the pixel
+ * @param index the index of the pixel in the image
+ * @param pixel the pixel
+ * @return true if the pixel was filled in and must not be traced
+ */
+static bool restored(image_band* b, int index, Vector<3, uc>& pixel) {
+  if(saving == NULL || !saving->restore(index, pixel)) {
+    return false;
+  }
+
+  b->finish();
+  return true;
+}
 #ifdef DEBUG
 bool camera::print = false;
 #else
 concurrent_queue<ray> ray::rays;
-int camera::running = 0;
 std::condition_variable_any wait_on;
 std::mutex                  lock_on;
 unsigned int                numb_on;
 int                         block_on;
 
 /**
- * Simple wrapper function passed into the creation of threads
+ * The job run by each thread of the worker pool, traces rays until the queue
+ * is empty, or closed if it was opened.
  */
-void wrapper() {
+void ray::work() {
   ray::rays.worker();
-  camera::running--;
+}
+
+/**
+ * The image that click() is rendering, handed out to the workers a band at a
+ * time so that no ray exists before a worker is ready to trace it.
+ */
+static struct {
+  camera*          c;       ///< the camera that is rendering
+  const model*     m;       ///< the model being rendered
+  display*         screen;  ///< where finished bands go
+  int              rows;    ///< rows in a band
+  std::atomic<int> next;    ///< the first row that has not been claimed
+} frame;
+
+/**
+ * The job run by each thread of the worker pool during click(), claims bands
+ * of the image and traces them until every row has been claimed.
+ */
+static void claim() {
+  const cv::Mat& image = frame.c->image();
+  int first;
+
+  while((first = frame.next.fetch_add(frame.rows)) < image.rows) {
+    frame.c->trace(frame.m, new image_band(frame.screen, first,
+        min(frame.rows, image.rows - first), image.cols));
+  }
 }
 
 #endif
 
+/**
+ * Smooths the light sampling noise out of an image that was just rendered,
+ * guided by the first hits the camera kept. Does nothing unless the denoiser
+ * was asked for.
+ *
+ * @param c the camera that rendered the image
+ * @param image the image, filtered in place
+ */
+static void denoise(const camera* c, cv::Mat& image) {
+  if(denoiser::passes <= 0 || c->primary() == NULL) {
+    return;
+  }
+
+  denoiser d(c, *c->primary(), image.cols, image.rows);
+  d.filter(image);
+  if(model::stats) {
+    d.report();
+  }
+}
+
 /**
  * Entry function for the ray tracing process. This takes a model and uses it to
- * generate an images and save it to a file named output.png
+ * generate an images and save it to a file named output.png. If a heatmap
+ * metric has been selected the cost of each pixel is saved to output_cost.png.
+ * The image is kept by the camera until the next click
  *
  * @param m
  * @return
  */
 void camera::click(const model* m) {
   /* locals */
-  cv::Mat raw_image(vmax() - vmin() + 1, umax() - umin() + 1, CV_8UC3);
-  vector<std::thread*> threads;
+  _image = cv::Mat(vmax() - vmin() + 1, umax() - umin() + 1, CV_8UC3);
+  cv::Mat& raw_image = _image;
   Vector<3> U;
   point L;
 
+  if(heatmap::mode != heatmap::none) {
+    _cost = new heatmap(raw_image.cols, raw_image.rows);
+  }
+
+  if(gbuffer::enabled || raster::enabled) {
+    delete _gbuffer;
+    _gbuffer = new gbuffer(raw_image.cols, raw_image.rows);
+  }
+
+  /* pick up where a render that was killed left off. The pixels that were
+   * done are not traced again, so their first hits are drawn instead */
+  int resumed = 0;
+#ifndef DEBUG
+  checkpoint* save = NULL;
+  if(!checkpoint::file.empty()) {
+    save = new checkpoint(checkpoint::file, raw_image.cols, raw_image.rows);
+    resumed = checkpoint::resume ? save->load() : 0;
+    if(resumed > 0 && _gbuffer != NULL && m->pages() != NULL) {
+      cerr << "ERROR: the first hits of an out of core model cannot be drawn, starting over" << endl;
+      delete save;
+      save = new checkpoint(checkpoint::file, raw_image.cols, raw_image.rows);
+      resumed = 0;
+    }
+  }
+#endif
+
+  /* draw the primary hits, the rays then start at the first bounce */
+  if((raster::enabled || (resumed > 0 && _gbuffer != NULL)) && m->pages() == NULL) {
+    long long start = trace::now();
+    raster ids(m, this);
+    ids.fill(*_gbuffer);
+    _gbuffer->ready() = true;
+    if(model::stats) {
+      ids.report();
+      cout << "raster: g-buffer filled in " << (trace::now() - start) / 1e6 << " ms" << endl;
+    }
+  }
+
   /* two different versions of this function can be compiled.
    *   1. A debugging version that runs purely in the main thread. This has
    *      the advantage that it can print all the information for a specific
@@ -88,23 +220,25 @@ void camera::click(const model* m) {
    *
    *   2. The standard threaded version. This has evolved over time into
    *      the current version. Currently this will display an image to the
-   *      screen and show the rendering process in real time. It will check
-   *      the number of threads available on the system. One thread will be
-   *      reserved for the display (the main thread). The other threads will
-   *      be allocated to the rendering process.
+   *      screen and show the rendering process in real time. The main
+   *      thread is kept for the display, the rendering is done by the
+   *      threads of the worker pool.
    */
+  ray::begin();
+#ifdef DEBUG
   for(int x = umin(); x <= umax(); x++) {
     for(int y = vmin(); y <= vmax(); y++) {
       L = vrp() + x*u() + y*v();
       U = L - focal_point(); U.normalize();
-#ifdef DEBUG
       if(x == X_PRINT && y == Y_PRINT)
         print = true;
-      ray(m, this, L, U, raw_image.at<Vector<3, uc> >(vmax() - y, x - umin()))();
+      ray(m, this, L, U, raw_image.at<Vector<3, uc> >(vmax() - y, x - umin()),
+          (vmax() - y) * raw_image.cols + x - umin())();
       if(x == X_PRINT && y == Y_PRINT)
         print = false;
     }
   }
+  denoise(this, raw_image);
 
   Vector<3, uc> fill(255);
   raw_image.at<Vector<3, uc> >(X_PRINT - umin() - 1, Y_PRINT - vmin() - 1) = fill;
@@ -116,43 +250,465 @@ void camera::click(const model* m) {
   raw_image.at<Vector<3, uc> >(X_PRINT - umin() + 1, Y_PRINT - vmin() + 1) = fill;
   raw_image.at<Vector<3, uc> >(X_PRINT - umin() + 1, Y_PRINT - vmin()    ) = fill;
 #else
-      ray::rays.push(new ray(m, this, L, U, raw_image.at<Vector<3, uc> >(vmax() - y, x - umin())));
-    }
-  }
+  trace::thread_name("main");
 
-  numb_on = 1;
-  block_on = 1;
+  /* the workers claim the image a band at a time and trace it, the display
+   * copies each band into the image once it has finished */
+  int rows = max(image_writer::band_rows, 1);
+  display screen(raw_image, "win", (raw_image.rows + rows - 1) / rows);
 
-  int n_thread = std::max(int(std::thread::hardware_concurrency()- 1), 1);
-  for(int i = 0; i < n_thread; i++) {
-    running++;
-    threads.push_back(new std::thread(wrapper));
+  if(save != NULL) {
+    saving = save;
+    save->start();
   }
 
-  while(running) {
-    cv::imshow("win", raw_image);
-    if(numb_on == std::thread::hardware_concurrency()) {
-      cv::waitKey(0);
-      block_on++;
-      wait_on.notify_all();
-      while(numb_on != 1)
-        usleep(100);
+  if(ray::schedule == ray::banded) {
+    frame.c      = this;
+    frame.m      = m;
+    frame.screen = &screen;
+    frame.rows   = rows;
+    frame.next   = 0;
+
+    pool::workers().start(claim);
+    screen.run();
+    pool::workers().wait();
+  } else {
+    /* every primary ray goes in the queue and the bounces are traced in the
+     * order of the schedule, so the display shows the bands as they are and
+     * not only once they finish */
+    vector<image_band*> bands;
+    for(int first = 0; first < raw_image.rows; first += rows) {
+      bands.push_back(new image_band(&screen, first, min(rows, raw_image.rows - first), raw_image.cols));
     }
+    screen.watch(&bands);
 
-    cv::waitKey(30);
+    ray::rays.open();
+    pool::workers().start(ray::work);
+    for(auto iter = bands.begin(); iter != bands.end(); iter++) {
+      generate(m, *iter);
+    }
+    ray::rays.close();
+    screen.run();
+    pool::workers().wait();
+
+    for(auto iter = bands.begin(); iter != bands.end(); iter++) {
+      delete *iter;
+    }
+  }
+
+  if(save != NULL) {
+    saving = NULL;
+    save->stop();
+    if(model::stats) {
+      save->report();
+    }
+    delete save;
   }
 
-  for(int i = 0; i < n_thread; i++) {
-    threads[i]->join();
+  if(model::stats) {
+    screen.report();
   }
+  denoise(this, raw_image);
 
   std::cout << "hello?" << std::endl;
   cv::imshow("win", raw_image);
   cv::waitKey(-1);
 #endif
 
+  if(_gbuffer != NULL) {
+    _gbuffer->ready() = true;
+  }
+
   /* create the output image */
   cv::imwrite("output.png", raw_image);
+
+  if(_cost != NULL) {
+    _cost->write("output_cost.png");
+    delete _cost;
+    _cost = NULL;
+  }
+}
+
+/**
+ * Renders the image again after lights or materials of the model were changed,
+ * starting every pixel from the first hit kept by the last click() instead of
+ * tracing its primary ray. Shading, shadow rays and reflections are all done
+ * again. Nothing is displayed.
+ *
+ * @param m the model that was clicked, with its lights or materials edited
+ * @param filename the image file to write
+ * @return false if there is no first hit to start from
+ */
+bool camera::reshade(const model* m, const string& filename) {
+  if(_gbuffer == NULL || !_gbuffer->ready()) {
+    return false;
+  }
+
+  specialize(m);
+  ray::begin();
+
+  Vector<3, uc> black(0);
+  for(int y = 0; y < _image.rows; y++) {
+    for(int x = 0; x < _image.cols; x++) {
+      _image.at<Vector<3, uc> >(y, x) = black;
+    }
+  }
+
+  Vector<3> U;
+  point L;
+  for(int x = umin(); x <= umax(); x++) {
+    for(int y = vmin(); y <= vmax(); y++) {
+      L = vrp() + x*u() + y*v();
+      U = L - focal_point(); U.normalize();
+#ifdef DEBUG
+      ray(m, this, L, U, _image.at<Vector<3, uc> >(vmax() - y, x - umin()),
+          (vmax() - y) * _image.cols + x - umin())();
+#else
+      ray::rays.push(new ray(m, this, L, U, _image.at<Vector<3, uc> >(vmax() - y, x - umin()),
+          (vmax() - y) * _image.cols + x - umin()));
+#endif
+    }
+  }
+
+#ifndef DEBUG
+  pool::workers().start(ray::work);
+  pool::workers().wait();
+#endif
+
+  denoise(this, _image);
+  cv::imwrite(filename, _image);
+  return true;
+}
+
+/**
+ * Renders straight to the file named by image_writer::file instead of
+ * output.png. Rays are only made for a few bands of rows at a time, each band
+ * is written out as soon as its last ray finishes, so the frame is never held
+ * in memory as a whole. Nothing is displayed while streaming.
+ *
+ * @param m the model to render
+ */
+void camera::stream(const model* m) {
+  int width = umax() - umin() + 1, height = vmax() - vmin() + 1;
+  int rows = std::max(image_writer::band_rows, 1);
+
+#ifndef DEBUG
+  trace::thread_name("main");
+  image_writer out(image_writer::file, width, height, pool::workers().size() + 2);
+  if(!out.ok()) {
+    return;
+  }
+
+  ray::rays.open();
+  pool::workers().start(ray::work);
+#else
+  image_writer out(image_writer::file, width, height, 1);
+  if(!out.ok()) {
+    return;
+  }
+#endif
+
+  /* only once the writer is open, a writer that failed leaves nothing set */
+  if(heatmap::mode != heatmap::none) {
+    _cost = new heatmap(width, height);
+  }
+
+  ray::begin();
+
+  for(int first = 0; first < height; first += rows) {
+    generate(m, out.start(first, std::min(rows, height - first)));
+  }
+
+#ifndef DEBUG
+  ray::rays.close();
+  pool::workers().wait();
+#endif
+
+  out.close();
+  if(model::stats) {
+    cout << "stream: " << out.peak() / 1024 << " KiB peak in bands of " << rows << " rows" << endl;
+  }
+
+  if(_cost != NULL) {
+    _cost->write("output_cost.png");
+    delete _cost;
+    _cost = NULL;
+  }
+}
+
+/**
+ * Creates the primary rays for every pixel of a band. The rays are pushed on
+ * the ray queue, or in a debug build traced right away.
+ *
+ * @param m the model to render
+ * @param b the band, its rows are rows of the whole image
+ */
+void camera::generate(const model* m, image_band* b) {
+  generate(m, b, b->first, b->rows);
+}
+
+/**
+ * Creates the primary rays for some of the rows of a band.
+ *
+ * @param m the model to render
+ * @param b the band the rows belong to
+ * @param first the first row of the image to create rays for
+ * @param rows the number of rows
+ */
+void camera::generate(const model* m, image_band* b, int first, int rows) {
+  /* the last pixel may finish the band and free it, see trace() */
+  int top = b->first, width = b->width;
+  Vector<3, uc>* pixels = &b->pixels[0];
+  long long start = trace::enabled ? trace::now() : 0;
+  Vector<3> U;
+  point L;
+
+  for(int x = umin(); x <= umax(); x++) {
+    for(int y = vmax() - first; y > vmax() - first - rows; y--) {
+      L = vrp() + x*u() + y*v();
+      U = L - focal_point(); U.normalize();
+
+      int row = vmax() - y;
+      Vector<3, uc>& pixel = pixels[(row - top) * width + x - umin()];
+      if(restored(b, row * width + x - umin(), pixel)) {
+        continue;
+      }
+
+      ray* r = new ray(m, this, L, U, pixel, row * width + x - umin());
+      r->band() = b;
+#ifdef DEBUG
+      (*r)();
+      delete r;
+#else
+      ray::rays.push(r);
+#endif
+    }
+  }
+
+  if(trace::enabled) trace::record("generate", start, first);
+}
+
+/**
+ * Traces every pixel of a band in the calling thread, one ray at a time. The
+ * band is handed to its owner when the last ray finishes and must not be
+ * used after this returns.
+ *
+ * @param m the model to render
+ * @param b the band, its rows are rows of the whole image
+ */
+void camera::trace(const model* m, image_band* b) {
+  /* the last pixel hands the band to its owner, which may free it right
+   * away, so nothing of the band is read once its pixels are handed out */
+  int first = b->first, rows = b->rows, width = b->width;
+  Vector<3, uc>* pixels = &b->pixels[0];
+  trace_span span("band", first);
+  Vector<3> U;
+  point L;
+
+  for(int row = first; row < first + rows; row++) {
+    int y = vmax() - row;
+    for(int x = umin(); x <= umax(); x++) {
+      Vector<3, uc>& pixel = pixels[(row - first) * width + x - umin()];
+      if(restored(b, row * width + x - umin(), pixel)) {
+        continue;
+      }
+
+      L = vrp() + x*u() + y*v();
+      U = L - focal_point(); U.normalize();
+
+      ray r(m, this, L, U, pixel, row * width + x - umin());
+      r.band() = b;
+      while(r());
+    }
+  }
+}
+
+/**
+ * Collects the frames of a multi camera render as their last rays finish.
+ */
+class view_sink : public band_sink {
+  public:
+
+    view_sink() : _lock(), _done(), _ready() { }
+    virtual ~view_sink() { }
+
+    /**
+     * Called by the last ray of a frame.
+     *
+     * @param b the frame
+     */
+    virtual void finish(image_band* b) {
+      std::unique_lock<std::mutex> ul(_lock);
+      _done.push_back(b);
+      _ready.notify_one();
+    }
+
+    /**
+     * @return the next frame to finish, waits for one if there is none
+     */
+    image_band* next() {
+      std::unique_lock<std::mutex> ul(_lock);
+      while(_done.empty()) {
+        _ready.wait(ul);
+      }
+
+      image_band* b = _done.front();
+      _done.pop_front();
+      return b;
+    }
+
+  protected:
+
+    std::mutex               _lock;   ///< protects _done
+    std::deque<image_band*>  _done;   ///< frames that have finished
+    std::condition_variable  _ready;  ///< signaled when a frame finishes
+};
+
+/**
+ * Renders several views of one model in a single pass. The rows of every
+ * view are handed to the worker pool a band at a time, taking turns between
+ * the views, so all of them share the queue and the geometry they touch
+ * stays in the caches. Each view is written to output_<n>.png, numbered from
+ * 1 in the order of the cameras, as soon as it is finished. Nothing is
+ * displayed.
+ *
+ * @param m the model to render
+ * @param views the cameras
+ */
+void camera::click(const model* m, const vector<camera*>& views) {
+  int rows = std::max(image_writer::band_rows, 1), tallest = 0;
+  view_sink sink;
+  vector<image_band*> frames;
+
+  for(auto iter = views.begin(); iter != views.end(); iter++) {
+    const camera* c = *iter;
+    frames.push_back(new image_band(&sink, 0, c->vmax() - c->vmin() + 1, c->umax() - c->umin() + 1));
+    tallest = std::max(tallest, frames.back()->rows);
+  }
+
+  ray::begin();
+#ifndef DEBUG
+  trace::thread_name("main");
+  ray::rays.open();
+  pool::workers().start(ray::work);
+#endif
+
+  for(int first = 0; first < tallest; first += rows) {
+    for(unsigned int k = 0; k < views.size(); k++) {
+      if(first < frames[k]->rows) {
+        views[k]->generate(m, frames[k], first, std::min(rows, frames[k]->rows - first));
+      }
+    }
+  }
+
+#ifndef DEBUG
+  ray::rays.close();
+#endif
+
+  /* write each view as it finishes while the rest are still rendering */
+  for(unsigned int n = 0; n < views.size(); n++) {
+    image_band* b = sink.next();
+    unsigned int k = std::find(frames.begin(), frames.end(), b) - frames.begin();
+    trace_span span("encode", k);
+
+    cv::Mat image(b->rows, b->width, CV_8UC3);
+    for(int y = 0; y < b->rows; y++) {
+      for(int x = 0; x < b->width; x++) {
+        image.at<Vector<3, uc> >(y, x) = b->pixels[y * b->width + x];
+      }
+    }
+
+    ostringstream name;
+    name << "output_" << k + 1 << ".png";
+    cv::imwrite(name.str(), image);
+  }
+
+#ifndef DEBUG
+  pool::workers().wait();
+#endif
+
+  for(auto iter = frames.begin(); iter != frames.end(); iter++) {
+    delete *iter;
+  }
+}
+
+/**
+ * Renders the image without showing it or writing it to a file. The image is
+ * kept by the camera as it is after click(), so renders can be timed and
+ * compared without anyone at the window.
+ *
+ * @param m the model to render
+ */
+void camera::render(const model* m) {
+  int width = umax() - umin() + 1, height = vmax() - vmin() + 1;
+  view_sink sink;
+  image_band* b = new image_band(&sink, 0, height, width);
+
+  ray::begin();
+#ifndef DEBUG
+  ray::rays.open();
+  pool::workers().start(ray::work);
+#endif
+
+  generate(m, b);
+
+#ifndef DEBUG
+  ray::rays.close();
+#endif
+  sink.next();
+#ifndef DEBUG
+  pool::workers().wait();
+#endif
+
+  _image = cv::Mat(height, width, CV_8UC3);
+  for(int y = 0; y < height; y++) {
+    for(int x = 0; x < width; x++) {
+      _image.at<Vector<3, uc> >(y, x) = b->pixels[y * width + x];
+    }
+  }
+  delete b;
+}
+
+/* every kernel, indexed by specular * 8 + spheres * 4 + polygons * 2 + one light */
+#define KERNEL(s, sp, p, o) &camera::shade<s, sp, p, o>
+static const camera::kernel kernels[16] = {
+  KERNEL(false, false, false, false), KERNEL(false, false, false, true),
+  KERNEL(false, false, true,  false), KERNEL(false, false, true,  true),
+  KERNEL(false, true,  false, false), KERNEL(false, true,  false, true),
+  KERNEL(false, true,  true,  false), KERNEL(false, true,  true,  true),
+  KERNEL(true,  false, false, false), KERNEL(true,  false, false, true),
+  KERNEL(true,  false, true,  false), KERNEL(true,  false, true,  true),
+  KERNEL(true,  true,  false, false), KERNEL(true,  true,  false, true),
+  KERNEL(true,  true,  true,  false), KERNEL(true,  true,  true,  true),
+};
+#undef KERNEL
+
+/**
+ * Picks the kernel that matches the features a model uses. Until this is
+ * called the camera uses the kernel that handles everything. Also builds the
+ * per tile lists that cull what the primary rays test, see frustum.
+ *
+ * @param m the model that will be rendered
+ */
+void camera::specialize(const model* m) {
+  bool specular = m->specular() || m->translucent();
+  bool spheres = m->has_spheres();
+  bool polygons = m->has_polygons();
+  bool one_light = m->lights().size() == 1 && m->lights()[0].directional();
+
+  _kernel = kernels[specular * 8 + spheres * 4 + polygons * 2 + one_light];
+
+  delete _frustum;
+  _frustum = frustum::tile > 0 ? new frustum(m, this) : NULL;
+
+  if(model::stats) {
+    cout << "kernel: specular " << (specular ? "on" : "off") << ", "
+         << (spheres ? "spheres" : "no spheres") << ", " << (polygons ? "polygons" : "no polygons")
+         << ", " << (one_light ? "one directional light" : "any lights") << endl;
+    if(_frustum != NULL) {
+      _frustum->report();
+    }
+  }
 }
 
 /**
@@ -160,29 +716,56 @@ void camera::click(const model* m) {
  * the ray intersects with. Once found this will call the function to calculate
  * the color of the light effecting the pixel and return it.
  *
+ * The template parameters say which features of the renderer the scene uses,
+ * the code for the rest is left out of the kernel.
+ *
  * @param r the ray that needs the color calculated
  * @return the color change based upon the input ray
  */
-Vector<3> camera::ray_color(ray* r) const {
-  tuple<point, double, const surface*> i, t;
-  get<1>(i) = numeric_limits<double>::infinity();
+template<bool SPECULAR, bool SPHERES, bool POLYGONS, bool ONE_LIGHT>
+Vector<3> camera::shade(ray* r) const {
+  const model* m = r->world();
   double cont = r->cont();
 
-  for(auto iter = r->world()->begin(); iter != r->world()->end(); iter++) {
-    t = (*iter)->intersection(r->dir(), r->src(), r->surf());
+  /* the primary hit is known from an earlier render */
+  if(r->depth() == 0 && _gbuffer != NULL && _gbuffer->ready()) {
+    const gbuffer::sample& g = (*_gbuffer)[r->index()];
+    if(g.h.type != hit::none) {
+      return cont * reflectance<SPECULAR, SPHERES, POLYGONS, ONE_LIGHT>(r, g.p, g.n, m->mat(g.material), g.h);
+    }
+
+    r->cont() = 0;
+    return Vector<3>(0);
+  }
+
+  const cull_list* part = r->depth() == 0 && _frustum != NULL ? (*_frustum)[r->index()] : NULL;
+  hit i = part != NULL ? m->intersection<SPHERES, POLYGONS>(r->dir(), r->src(), *part) :
+      m->intersection<SPHERES, POLYGONS>(r->dir(), r->src(), r->surf());
+
+  /* part of the scene is not in memory, try again once it is */
+  if(page_cache::deferred) {
+    return Vector<3>(0);
+  }
+
+  /* the point is only needed once something was hit */
+  if(i.type != hit::none) {
+    point p = i.at(r->dir(), r->src());
+    Vector<3> n = m->normal(i, p);
+    int mat = m->mat_index(i);
 
-    if(get<1>(t) > 0 && get<1>(t) < get<1>(i)) {
-      i = t;
+    if(r->depth() == 0 && _gbuffer != NULL) {
+      gbuffer::sample& g = (*_gbuffer)[r->index()];
+      g.h = i;
+      g.p = p;
+      g.n = n;
+      g.material = mat;
     }
+
+    return cont * reflectance<SPECULAR, SPHERES, POLYGONS, ONE_LIGHT>(r, p, n, m->mat(mat), i);
   }
 
-  if(get<2>(i) != NULL) {
-    return cont * reflectance(
-        r,
-        get<0>(i),
-        get<2>(i)->normal(get<0>(i)),
-        r->world()->mat(get<2>(i)->material()),
-        get<2>(i));
+  if(r->depth() == 0 && _gbuffer != NULL) {
+    (*_gbuffer)[r->index()].h = i;
   }
 
   r->cont() = 0;
@@ -202,38 +785,82 @@ Vector<3> camera::ray_color(ray* r) const {
  * @param s the surface that it intersected
  * @return Vector<3> that is the color of the ray
  */
-Vector<3> camera::reflectance(ray* r, point p, Vector<3> n, const material& mat, const surface* s) const {
+template<bool SPECULAR, bool SPHERES, bool POLYGONS, bool ONE_LIGHT>
+Vector<3> camera::reflectance(ray* r, point p, Vector<3> n, const material& mat, const hit& s) const {
   Vector<3> Lp, Rp(4), Rl(4);
   Vector<3> ret;
   Vector<3> v = r->dir();
-  v.normalize();
-  n.normalize();
+  fastmath::normalize(v);
+  fastmath::normalize(n);
   v.negate();
 
   if(v.dot(n) < 0) {
     n.negate();
   }
 
+  /* pick the lights that are worth shading, see light_tree. A single
+   * directional light is always picked. */
+  static thread_local vector<pair<int, double> > selected;
+  if(ONE_LIGHT) {
+    selected.assign(1, pair<int, double>(0, 1.0));
+  } else {
+    double kd = max(mat.diffuse()[0][0], max(mat.diffuse()[1][1], mat.diffuse()[2][2]));
+    r->world()->ltree().select(p, n, r->cont() * kd, r->cont() * mat.ks(),
+        (unsigned long)(r->index()) * (MAX_DEPTH + 2) + r->depth(), selected);
+  }
+
   /* add each light the red, green and blue values */
-  for(auto light = r->world()->lbegin(); light != r->world()->lend(); light++) {
+  for(auto iter = selected.begin(); iter != selected.end(); iter++) {
+    const light* light = &r->world()->lights()[iter->first];
     /* calculate the direction of the light source and angle of reflectance*/
-    Lp = light->direction(p); Lp.normalize();
+    Lp = light->direction(p); fastmath::normalize(Lp);
     /* calculate the actual reflectance values */
-    if(Lp.dot(n) < 0 || shadowed(p, light->direction(p), r->world(), s)) {
+    if(Lp.dot(n) < 0 || shadowed<SPHERES, POLYGONS>(p, light->direction(p), r->world(), s, iter->first)) {
       continue;
     }
 
-    Rl = (2 * (Lp.dot(n))) * n - Lp; Rl.normalize();
-    ret += (mat.diffuse() * light->illumination() * Lp.dot(n)) + (light->illumination() * mat.ks() * pow(max(0.0, v.dot(Rl)), mat.alpha()));
+    if(SPECULAR) {
+      Rl = (2 * (Lp.dot(n))) * n - Lp; fastmath::normalize(Rl);
+      ret += iter->second * ((mat.diffuse() * light->illumination() * Lp.dot(n)) + (light->illumination() * mat.ks() * fastmath::pow(max(0.0, v.dot(Rl)), mat.alpha())));
+    } else {
+      ret += iter->second * (mat.diffuse() * light->illumination() * Lp.dot(n));
+    }
   }
 
-  /* recursively calculate new rays */
-  Rp = (2 * (v.dot(n))) * n - v; Rp.normalize();
-  r->dir()  = Rp;
-  r->src()  = p;
-  r->surf() = s;
-  r->cont() = mat.ks() * r->cont();
-  r->depth()++;
+  /* a shadow ray needed geometry that is not in memory, leave the ray as it
+   * was so the bounce can be done again */
+  if(page_cache::deferred) {
+    return Vector<3>(0);
+  }
+
+  /* recursively calculate new rays, nothing in the scene reflects so the
+   * ray ends here */
+  if(SPECULAR) {
+    double reflected = mat.ks();
+
+    /* light through a translucent surface bends going in or out, and past
+     * the critical angle all of it is reflected */
+    if(mat.kt() != 0) {
+      double from = r->density(), to = from == 1.0 && mat.density() > 0 ? mat.density() : 1.0;
+      double eta = from / to, cosi = v.dot(n), k = 1 - eta * eta * (1 - cosi * cosi);
+
+      if(k < 0) {
+        reflected += mat.kt();
+      } else {
+        Vector<3> T = (eta * cosi - std::sqrt(k)) * n - eta * v; fastmath::normalize(T);
+        r->split(p, T, s, mat.kt() * r->cont(), to);
+      }
+    }
+
+    Rp = (2 * (v.dot(n))) * n - v; fastmath::normalize(Rp);
+    r->dir()  = Rp;
+    r->src()  = p;
+    r->surf() = s;
+    r->cont() = reflected * r->cont();
+    r->depth()++;
+  } else {
+    r->cont() = 0;
+  }
 
   /* clip the colors */
   ret[0] = min(int(ret[0]), 255);
@@ -244,28 +871,37 @@ Vector<3> camera::reflectance(ray* r, point p, Vector<3> n, const material& mat,
 }
 
 /**
- * Checks if a particular light source is shadowed.
+ * Checks if a particular light source is shadowed. When the model has a
+ * shadow cache the ray is only traced if the cache does not know the answer,
+ * or to check the answer with shadow_cache::check.
  *
  * @param pt the location of the surface that the ray intersected
  * @param U the direction of the light from the point pt
  * @param m the model that is being rendered
  * @param s the surface that the current ray bounced off of
+ * @param light the index of the light in the model
  * @return true if the light source is shadowed for point pt
  */
-bool camera::shadowed(const point& pt, const Vector<3>& U, const model* m, const surface* s) const {
-  tuple<point, double, const surface*> inter;
+template<bool SPHERES, bool POLYGONS>
+bool camera::shadowed(const point& pt, const Vector<3>& U, const model* m, const hit& s, int light) const {
   Vector<3> tmp = U;
-  tmp.normalize();
+  fastmath::normalize(tmp);
+  double dist = fastmath::length(U);
 
-  for(auto iter = m->begin(); iter != m->end(); iter++) {
-    inter = (*iter)->intersection(tmp, pt, s);
+  shadow_cache* cache = m->shadows();
+  int known = cache == NULL ? -1 : cache->lookup(light, pt, s, tmp, dist);
+  if(known >= 0 && !shadow_cache::check) {
+    return known;
+  }
 
-    if(get<1>(inter) > 0 && get<1>(inter) < U.length()) {
-      return true;
-    }
+  heatmap::shadow_rays++;
+  bool ret = m->occluded<SPHERES, POLYGONS>(tmp, pt, s, dist);
+  if(known >= 0) {
+    cache->verify(known, ret);
+    return known;
   }
 
-  return false;
+  return ret;
 }
 
 /**
@@ -275,26 +911,161 @@ bool camera::shadowed(const point& pt, const Vector<3>& U, const model* m, const
  * @return true if ray is still valid, false if it has finished calculation
  */
 bool ray::operator()() {
+  trace_span span("bounce", _depth);
+  heatmap_span cost(_generator->cost(), _index);
+
   /*if(_depth == block_on) {
     std::unique_lock<std::mutex> lock(lock_on);
     numb_on++;
     wait_on.wait(lock);
     numb_on--;
   }*/
-  _pixel += _generator->ray_color(this);
+  /* out of time, the pixel keeps what it has so far */
+  if(deadline != 0 && trace::now() > deadline) {
+    late++;
+    _branches.clear();
+    if(_band != NULL) {
+      _band->finish();
+    }
+    return false;
+  }
+
+  page_cache::deferred = false;
+#ifdef DEBUG
+  page_cache::blocking = true;
+#else
+  page_cache::blocking = _deferrals >= MAX_DEFERRALS;
+#endif
+
+  Vector<3> color = _generator->ray_color(this);
+  if(page_cache::deferred) {
+    _deferrals++;
+    std::this_thread::yield();
+    return true;
+  }
+
+  _deferrals = 0;
+  _pixel += color;
   _pixel[0] = min(int(_pixel[0]), 255);
   _pixel[1] = min(int(_pixel[1]), 255);
   _pixel[2] = min(int(_pixel[2]), 255);
 
+  bool full = _pixel[0] == 255 && _pixel[1] == 255 && _pixel[2] == 255;
+  bool more = !(_cont < 0.0039 || _depth > MAX_DEPTH || full);
+  _bounces++;
+
+  /* once the tree has split, a path that matters little survives at random
+   * and is weighted up when it does, so on average the color is the same */
+  if(more && _split && _cont < roulette) {
+    if(light_tree::uniform((unsigned long long)(_index) << 32 | _bounces) * roulette < _cont) {
+      _cont = roulette;
+    } else {
+      more = false;
+      killed++;
+    }
+  }
+
+  if(_bounces >= budget && (more || !_branches.empty()) && !full) {
+    more = false;
+    _branches.clear();
+    cut++;
+  }
+
+  /* this path is done, go on with the branch that matters most */
+  if(!more && !full && !_branches.empty()) {
+    auto best = _branches.begin();
+    for(auto iter = _branches.begin(); iter != _branches.end(); iter++) {
+      if(iter->cont > best->cont) {
+        best = iter;
+      }
+    }
+
+    _src_point = best->src;
+    _direction = best->dir;
+    _src       = best->surf;
+    _cont      = best->cont;
+    _depth     = best->depth;
+    _density   = best->density;
+    _branches.erase(best);
+    more = true;
+  }
+
 #ifdef DEBUG
-  if(!(_cont < 0.0039 || _depth > MAX_DEPTH ||
-      (_pixel[0] == 255 && _pixel[1] == 255 && _pixel[2] == 255)))
+  if(more)
     return this->operator()();
-  return false;
-#else
-  return !(_cont < 0.0039 || _depth > MAX_DEPTH ||
-        (_pixel[0] == 255 && _pixel[1] == 255 && _pixel[2] == 255));
 #endif
+  if(!more && _band != NULL) {
+    if(saving != NULL) {
+      saving->done(_index, _pixel);
+    }
+    _band->finish();
+  }
+  return more;
+}
+
+/**
+ * Leaves part of the ray tree to be traced once the current path is done. The
+ * branch belongs to the same pixel and is traced by the same ray, one after
+ * the other, so the paths of a pixel never run at the same time.
+ *
+ * @param src where the branch starts
+ * @param dir the normalized direction of the branch
+ * @param surf the surface the branch leaves
+ * @param cont how much the branch effects the pixel
+ * @param density the density of what the branch travels through
+ */
+void ray::split(const point& src, const Vector<3>& dir, const hit& surf, double cont, double density) {
+  if(cont < 0.0039 || _depth >= MAX_DEPTH) {
+    return;
+  }
+
+  branch b = { src, dir, surf, cont, _depth + 1, density };
+  _branches.push_back(b);
+  _split = true;
+  branches++;
+}
+
+/**
+ * Prints how the ray trees of translucent surfaces were cut short.
+ */
+void ray::report() {
+  cout << "rays: " << branches << " branches, " << killed << " ended by russian roulette below "
+       << roulette << ", " << cut << " pixels over the budget of " << budget << " bounces";
+  if(time_budget > 0) {
+    cout << ", " << late << " pixels out of time after " << time_budget << " ms";
+  }
+  cout << endl;
+}
+
+/**
+ * Starts the clock of the time budget and orders the queue for a render, the
+ * queue must be empty.
+ */
+void ray::begin() {
+  deadline = time_budget > 0 ? trace::now() + (long long)(time_budget * 1e6) : 0;
+#ifndef DEBUG
+  rays.order(schedule == contribution);
+#endif
+}
+
+/**
+ * Sets the schedule from its name on the command line.
+ *
+ * @param name band, fifo or contribution
+ * @return false if the name is not a schedule
+ */
+bool ray::parse(const string& name) {
+  if(name == "band") {
+    schedule = banded;
+  } else if(name == "fifo") {
+    schedule = fifo;
+  } else if(name == "contribution") {
+    schedule = contribution;
+  } else {
+    return false;
+  }
+
+  return true;
 }
 
 /**
@@ -12,6 +12,10 @@
 #ifndef CAMERA_H_INCLUDE
 #define CAMERA_H_INCLUDE
 
+#include <frustum.h>
+#include <gbuffer.h>
+#include <heatmap.h>
+#include <image_writer.h>
 #include <lexer.h>
 #include <model.h>
 #include <queue.tpp>
@@ -20,6 +24,8 @@
 #include <utility>
 using std::pair;
 
+#include <cv.h>
+
 typedef unsigned char uc;
 class camera;
 
@@ -35,6 +41,9 @@ class camera;
 class ray {
   public:
 
+    /** the order rays are traced in, see schedule */
+    enum order { banded, fifo, contribution };
+
     /**
      * Basic constructor for the ray class.
      *
@@ -43,11 +52,13 @@ class ray {
      * @param _src_p the location that the ray is extending from
      * @param _dir   the direction that the ray is pointing in
      * @param _pixel the pixel is the destination image that this ray changes
+     * @param _index the index of the pixel in the destination image
      */
     ray(const model* _m, const camera* _gen, const point& _src_p,
-        const Vector<3>& _dir, Vector<3, uc>& _pixel) :
+        const Vector<3>& _dir, Vector<3, uc>& _pixel, int _index) :
       _m(_m),     _generator(_gen), _src_point(_src_p), _direction(_dir), _pixel(_pixel),
-      _src(NULL), _cont(1.0),       _depth(0),          _density(1.0) { }
+      _index(_index), _src(hit::miss(0)), _cont(1.0),         _depth(0),        _density(1.0),
+      _deferrals(0),  _band(NULL),        _bounces(0),        _split(false),    _branches() { }
 
     /**
      * Destructor, virtual in case someone could think of a reason to extend ray
@@ -61,32 +72,62 @@ class ray {
     /* ********************************************************************** */
 
     inline const model*    world()   const { return _m;         }
+    inline int             index()   const { return _index;     }
     inline point&          src()           { return _src_point; }
     inline point           src()     const { return _src_point; }
     inline Vector<3>&      dir()           { return _direction; }
     inline Vector<3>       dir()     const { return _direction; }
-    inline const surface*& surf()          { return _src;       }
-    inline const surface*  surf()    const { return _src;       }
+    inline hit&            surf()          { return _src;       }
+    inline const hit&      surf()    const { return _src;       }
     inline double&         cont()          { return _cont;      }
     inline double          cont()    const { return _cont;      }
     inline int&            depth()         { return _depth;     }
     inline int             depth()   const { return _depth;     }
     inline double&         density()       { return _density;   }
     inline double          density() const { return _density;   }
+    inline image_band*&    band()          { return _band;      }
+    inline double          priority() const { return _cont;     }
+
+    void split(const point& src, const Vector<3>& dir, const hit& surf, double cont, double density);
+
+    static void work();
+    static void report();
+    static void begin();
+    static bool parse(const string& name);
 
     static concurrent_queue<ray> rays;
+    static int                   budget;
+    static double                roulette;
+    static order                 schedule;
+    static double                time_budget;
 
   protected:
 
+    /** a part of the ray tree that is waiting to be traced */
+    struct branch {
+      point     src;      ///< where the branch starts
+      Vector<3> dir;      ///< the direction it travels in
+      hit       surf;     ///< the surface it leaves
+      double    cont;     ///< how much it effects the pixel
+      int       depth;    ///< the bounces before it
+      double    density;  ///< the density of what it travels through
+    };
+
     const model*    _m;         ///< model that is begin rendered
     const camera*   _generator; ///< camera taking a picture of the model
     point           _src_point; ///< the origin of the ray
     Vector<3>       _direction; ///< the direction the ray travels in
     Vector<3, uc>&  _pixel;     ///< refernce to the pixel this ray effects
-    const surface*  _src;       ///< the surface this ray bounced off of
+    int             _index;     ///< index of the pixel in the destination image
+    hit             _src;       ///< the surface this ray bounced off of
     double          _cont;      ///< how much the ray effects the pixel
     int             _depth;     ///< the number of bounces before this ray
-    double          _density;   ///< ???
+    double          _density;   ///< density of what the ray travels through, 1 outside of everything
+    int             _deferrals; ///< times this bounce waited for geometry to be paged in
+    image_band*     _band;      ///< the band the pixel belongs to when streaming, NULL otherwise
+    int             _bounces;   ///< bounces traced for the pixel, every branch included
+    bool            _split;     ///< the ray tree has more than one branch
+    vector<branch>  _branches;  ///< branches left to trace
 };
 
 /**
@@ -99,8 +140,12 @@ class ray {
  */
 class camera {
   public:
-    camera() : fp(4), _n(4), _u(4), _v(4) { };
-    virtual ~camera() { };
+    /** a ray_color() built for the features that a scene uses */
+    typedef Vector<3> (camera::*kernel)(ray* r) const;
+
+    camera() : fp(4), _n(4), _u(4), _v(4), _cost(NULL), _image(),
+      _kernel(&camera::shade<true, true, true, false>), _gbuffer(NULL), _frustum(NULL) { };
+    virtual ~camera() { delete _gbuffer; delete _frustum; };
 
     inline point& focal_point() { return fp; }
     inline point focal_point() const { return fp; }
@@ -122,26 +167,45 @@ class camera {
     inline int vmin() const { return _vmin; }
     inline int& vmax() { return _vmax; }
     inline int vmax() const { return _vmax; }
+    inline heatmap* cost() const { return _cost; }
+    inline const cv::Mat& image() const { return _image; }
+    inline const gbuffer* primary() const { return _gbuffer; }
 
     void click(const model* m);
-    Vector<3> ray_color(ray* r) const;
+    static void click(const model* m, const vector<camera*>& views);
+    void render(const model* m);
+    bool reshade(const model* m, const string& filename);
+    void stream(const model* m);
+    void generate(const model* m, image_band* b);
+    void generate(const model* m, image_band* b, int first, int rows);
+    void trace(const model* m, image_band* b);
+    void specialize(const model* m);
+    inline Vector<3> ray_color(ray* r) const { return (this->*_kernel)(r); }
+
+    template<bool SPECULAR, bool SPHERES, bool POLYGONS, bool ONE_LIGHT>
+    Vector<3> shade(ray* r) const;
 
 #ifdef DEBUG
     static bool print;
 #endif
 
-    static int running;
-
   protected:
 
-    Vector<3> reflectance(ray* r, point p, Vector<3> n, const material& mat, const surface* s) const;
-    bool shadowed(const point& pt, const Vector<3>& dir, const model* m, const surface* s) const;
+    template<bool SPECULAR, bool SPHERES, bool POLYGONS, bool ONE_LIGHT>
+    Vector<3> reflectance(ray* r, point p, Vector<3> n, const material& mat, const hit& s) const;
+    template<bool SPHERES, bool POLYGONS>
+    bool shadowed(const point& pt, const Vector<3>& dir, const model* m, const hit& s, int light) const;
 
     point fp, _vrp;
     Vector<3> _n, _u, _v;
     double fl;
     int _umin, _umax;
     int _vmin, _vmax;
+    heatmap* _cost;
+    cv::Mat  _image;
+    kernel   _kernel;  ///< the ray_color() picked by specialize()
+    gbuffer* _gbuffer; ///< the first hit of each pixel, NULL unless gbuffer::enabled
+    frustum* _frustum; ///< what the primary rays of each tile can hit, NULL if not culled
 };
 
 lexer& operator>>(lexer& istr, camera& c);
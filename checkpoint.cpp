@@ -0,0 +1,280 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <checkpoint.h>
+#include <trace.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+using std::cerr;
+using std::cout;
+using std::endl;
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* intialize statics */
+string             checkpoint::file   = "";
+double             checkpoint::every  = 60;
+bool               checkpoint::resume = false;
+unsigned long long checkpoint::key    = 0;
+
+/** what a checkpoint file starts with */
+struct checkpoint_header {
+  char     magic[4];  ///< "RTCP"
+  uint32_t version;   ///< the layout of the file, 1
+  uint32_t width;     ///< width of the image in pixels
+  uint32_t height;    ///< height of the image in pixels
+  uint64_t key;       ///< the fingerprint of the render, see checkpoint::key
+  uint64_t done;      ///< the number of pixels in the file
+};
+
+/** set by SIGTERM, the writer saves what it has and ends the process */
+static volatile sig_atomic_t terminated = 0;
+static struct sigaction      previous;
+
+/**
+ * Called when the process is asked to stop.
+ */
+static void on_term(int) {
+  terminated = 1;
+}
+
+/**
+ * Writes all of a buffer to a file.
+ *
+ * @return true if every byte was written
+ */
+static bool put(int fd, const void* data, size_t size) {
+  const char* at = (const char*)data;
+  while(size > 0) {
+    ssize_t n = ::write(fd, at, size);
+    if(n <= 0) {
+      return false;
+    }
+    at += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * Reads all of a buffer from a file.
+ *
+ * @return true if every byte was read
+ */
+static bool get(int fd, void* data, size_t size) {
+  char* at = (char*)data;
+  while(size > 0) {
+    ssize_t n = ::read(fd, at, size);
+    if(n <= 0) {
+      return false;
+    }
+    at += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * Creates an empty checkpoint, nothing is read or written until load() or
+ * start() is called.
+ *
+ * @param filename the file the checkpoint is kept in
+ * @param width the width of the image
+ * @param height the height of the image
+ */
+checkpoint::checkpoint(const string& filename, int width, int height) :
+    _filename(filename), _width(width), _height(height), _pixels(width * height),
+    _done(new std::atomic<uint8_t>[width * height]()), _lock(), _wake(), _thread(NULL),
+    _stop(false), _resumed(0), _writes(0), _bytes(0), _time(0) { }
+
+/**
+ * Stops the writer if it is running, the file is kept.
+ */
+checkpoint::~checkpoint() {
+  stop();
+  delete[] _done;
+}
+
+/**
+ * Reads the pixels that were done from the file. A file that is missing, bad
+ * or written by a different render is left alone and nothing is read.
+ *
+ * @return the number of pixels read
+ */
+int checkpoint::load() {
+  int fd = open(_filename.c_str(), O_RDONLY);
+  if(fd < 0) {
+    return 0;
+  }
+
+  checkpoint_header h;
+  int n = _width * _height;
+  vector<uint8_t> bits((n + 7) / 8), colors;
+  bool ok = get(fd, &h, sizeof(h)) && memcmp(h.magic, "RTCP", 4) == 0 && h.version == 1;
+  ok = ok && h.width == uint32_t(_width) && h.height == uint32_t(_height) && h.key == key;
+  ok = ok && h.done <= uint64_t(n) && get(fd, &bits[0], bits.size());
+  if(ok) {
+    colors.resize(h.done * 3);
+    ok = colors.empty() || get(fd, &colors[0], colors.size());
+  }
+  ::close(fd);
+
+  if(!ok) {
+    cerr << "ERROR: checkpoint " << _filename << " is not for this render, starting over" << endl;
+    return 0;
+  }
+
+  const uint8_t* c = colors.empty() ? NULL : &colors[0];
+  for(int i = 0; i < n && _resumed < int(h.done); i++) {
+    if(bits[i / 8] & (1 << (i % 8))) {
+      for(int k = 0; k < 3; k++) {
+        _pixels[i][k] = *c++;
+      }
+      _done[i] = 1;
+      _resumed++;
+    }
+  }
+
+  return _resumed;
+}
+
+/**
+ * Starts writing the checkpoint in the background, every checkpoint::every
+ * seconds and when the process is sent SIGTERM.
+ */
+void checkpoint::start() {
+  if(_thread != NULL) {
+    return;
+  }
+
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = on_term;
+  sigemptyset(&act.sa_mask);
+  sigaction(SIGTERM, &act, &previous);
+
+  _stop = false;
+  _thread = new std::thread(&checkpoint::run, this);
+}
+
+/**
+ * Stops the writer and writes the checkpoint a last time.
+ */
+void checkpoint::stop() {
+  if(_thread == NULL) {
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> ul(_lock);
+    _stop = true;
+    _wake.notify_one();
+  }
+
+  _thread->join();
+  delete _thread;
+  _thread = NULL;
+
+  sigaction(SIGTERM, &previous, NULL);
+  write();
+}
+
+/**
+ * The writer thread. Checks for SIGTERM several times a second, since only
+ * this thread may safely do anything about it.
+ */
+void checkpoint::run() {
+  trace::thread_name("checkpoint");
+  long long last = trace::now();
+
+  std::unique_lock<std::mutex> ul(_lock);
+  while(!_stop) {
+    _wake.wait_for(ul, std::chrono::milliseconds(100));
+
+    if(terminated) {
+      write();
+      cerr << "checkpoint: terminated, " << _filename << " saved" << endl;
+      std::_Exit(128 + SIGTERM);
+    }
+
+    if(!_stop && (trace::now() - last) / 1e9 >= every) {
+      ul.unlock();
+      write();
+      last = trace::now();
+      ul.lock();
+    }
+  }
+}
+
+/**
+ * Writes every pixel that is done to a temporary file and puts it in place of
+ * the last checkpoint.
+ *
+ * @return true if the checkpoint was written
+ */
+bool checkpoint::write() {
+  trace_span span("checkpoint", _writes);
+  long long start = trace::now();
+  int n = _width * _height;
+
+  vector<uint8_t> bits((n + 7) / 8, 0), colors;
+  colors.reserve(n * 3);
+  for(int i = 0; i < n; i++) {
+    if(_done[i].load(std::memory_order_acquire)) {
+      bits[i / 8] |= 1 << (i % 8);
+      for(int k = 0; k < 3; k++) {
+        colors.push_back(_pixels[i][k]);
+      }
+    }
+  }
+
+  checkpoint_header h;
+  memcpy(h.magic, "RTCP", 4);
+  h.version = 1;
+  h.width = _width;
+  h.height = _height;
+  h.key = key;
+  h.done = colors.size() / 3;
+
+  string tmp = _filename + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0 && put(fd, &h, sizeof(h)) && put(fd, &bits[0], bits.size()) &&
+      (colors.empty() || put(fd, &colors[0], colors.size())) && fsync(fd) == 0;
+  if(fd >= 0) {
+    ok = ::close(fd) == 0 && ok;
+  }
+  ok = ok && rename(tmp.c_str(), _filename.c_str()) == 0;
+
+  if(!ok) {
+    cerr << "ERROR: could not write checkpoint: " << _filename << endl;
+    return false;
+  }
+
+  _writes++;
+  _bytes = sizeof(h) + bits.size() + colors.size();
+  _time = (trace::now() - start) / 1e6;
+  return true;
+}
+
+/**
+ * Prints how much was resumed and written.
+ */
+void checkpoint::report() const {
+  cout << "checkpoint: " << _filename << ", resumed " << _resumed << " of " << _width * _height
+       << " pixels, " << _writes << " writes, last " << _bytes / 1024 << " KiB in " << _time
+       << " ms" << endl;
+}
@@ -0,0 +1,117 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef CHECKPOINT_H_INCLUDE
+#define CHECKPOINT_H_INCLUDE
+
+#include <Vector.tpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+using std::string;
+#include <thread>
+#include <vector>
+using std::vector;
+
+/**
+ * Saves the pixels of a render that have finished so that a render that was
+ * killed can go on where it stopped. The color of a pixel only depends on the
+ * pixel, the light samples and russian roulette are seeded by its index, so
+ * the pixels that are traced again after a resume come out exactly as they
+ * would have and the image is the same bit for bit.
+ *
+ * Each ray copies its pixel here when it finishes and marks it done, that is
+ * all the workers ever do. A background thread writes every pixel marked done
+ * to the file every so many seconds, see every, and once more when the render
+ * finishes or the process is sent SIGTERM. Each write goes to a temporary file that is
+ * renamed over the last one, so a kill while writing leaves the last
+ * checkpoint whole. The file holds a bitmap of the pixels that are done
+ * followed by their colors, and a fingerprint of the scene and command line
+ * so that a checkpoint is only resumed by the render that wrote it.
+ *
+ * When several scene files are rendered, the first scene after --checkpoint
+ * keeps its checkpoint in the file given and the n-th in that file with .n
+ * added, so a killed run resumes every scene from its own file.
+ *
+ * Only camera::click() keeps a checkpoint. Pixels cut short by
+ * ray::time_budget are not saved, they are traced again in full after a
+ * resume.
+ *
+ * @file checkpoint.h
+ */
+class checkpoint {
+  public:
+
+    checkpoint(const string& filename, int width, int height);
+    virtual ~checkpoint();
+
+    int load();
+    void start();
+    void stop();
+    void report() const;
+
+    /**
+     * Saves a pixel once its last ray has finished.
+     *
+     * @param index the index of the pixel in the image
+     * @param pixel its color
+     */
+    inline void done(int index, const Vector<3, unsigned char>& pixel) {
+      _pixels[index] = pixel;
+      _done[index].store(1, std::memory_order_release);
+    }
+
+    /**
+     * Gives the color of a pixel if it was finished before.
+     *
+     * @param index the index of the pixel in the image
+     * @param pixel set to its color if it was finished
+     * @return true if the pixel was finished and must not be traced again
+     */
+    inline bool restore(int index, Vector<3, unsigned char>& pixel) const {
+      if(!_done[index].load(std::memory_order_acquire)) {
+        return false;
+      }
+      pixel = _pixels[index];
+      return true;
+    }
+
+    static string             file;
+    static double             every;
+    static bool               resume;
+    static unsigned long long key;
+
+  protected:
+
+    void run();
+    bool write();
+
+    string                           _filename; ///< where the checkpoint is kept
+    int                              _width;    ///< width of the image in pixels
+    int                              _height;   ///< height of the image in pixels
+    vector<Vector<3, unsigned char> > _pixels;  ///< the color of every pixel that is done
+    std::atomic<uint8_t>*            _done;     ///< 1 for each pixel that is done
+
+    std::mutex                       _lock;     ///< protects _stop
+    std::condition_variable          _wake;     ///< signals the writer to stop
+    std::thread*                     _thread;   ///< the writer
+    bool                             _stop;     ///< the render is over
+
+    int                              _resumed;  ///< pixels read from the file
+    int                              _writes;   ///< checkpoints written
+    unsigned long                    _bytes;    ///< size of the last checkpoint
+    double                           _time;     ///< time taken by the last write in ms
+};
+
+#endif /* CHECKPOINT_H_INCLUDE */
@@ -0,0 +1,299 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <camera.h>
+#include <denoiser.h>
+#include <pool.h>
+#include <trace.h>
+
+#include <algorithm>
+using std::min;
+using std::max;
+#include <cmath>
+#include <iostream>
+using std::cout;
+using std::endl;
+
+/* intialize statics */
+int    denoiser::passes = 0;
+double denoiser::sigma  = 4;
+double denoiser::normal = 128;
+double denoiser::depth  = 0.25;
+
+/** the denoiser the workers are running a pass of */
+static denoiser* current = NULL;
+
+/**
+ * @param c a color
+ * @return how bright the color looks
+ */
+static inline float luma(const float* c) {
+  return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+/** the taps of the B3 spline that each pass blurs with */
+static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+/**
+ * Gathers the guide of every pixel from the first hits of the last render.
+ *
+ * @param c the camera that rendered the image
+ * @param g the first hit of each pixel
+ * @param width the width of the image in pixels
+ * @param height the height of the image in pixels
+ */
+denoiser::denoiser(const camera* c, const gbuffer& g, int width, int height) :
+    _width(width), _height(height), _guides(width * height), _from(), _to(),
+    _var(), _var_to(), _step(1), _next(0), _mixed(0), _time(0) {
+  double pixel = c->u().length();
+
+  for(int row = 0; row < height; row++) {
+    for(int col = 0; col < width; col++) {
+      const gbuffer::sample& s = g[row * width + col];
+      guide& d = _guides[row * width + col];
+
+      if(s.h.type == hit::none) {
+        d.material = -1;
+        continue;
+      }
+
+      point L = c->vrp() + (col + c->umin()) * c->u() + (c->vmax() - row) * c->v();
+      Vector<3> n = s.n, view = c->focal_point() - s.p;
+      n.normalize();
+      if(n.dot(view) < 0) {
+        n.negate();
+      }
+
+      for(int i = 0; i < 3; i++) {
+        d.n[i] = n[i];
+        d.p[i] = s.p[i];
+      }
+      d.foot = view.length() * pixel / (L - c->focal_point()).length();
+      d.material = s.material;
+      _mixed++;
+    }
+  }
+}
+
+/**
+ * Filters an image in place. Does nothing unless passes is set.
+ *
+ * @param image the image the guides were gathered for
+ */
+void denoiser::filter(cv::Mat& image) {
+  if(passes <= 0) {
+    return;
+  }
+
+  long long start = trace::now();
+  trace_span span("denoise", passes);
+
+  _from.resize(_width * _height * 3);
+  _to.resize(_from.size());
+  _var.resize(_width * _height);
+  _var_to.resize(_var.size());
+  for(int y = 0; y < _height; y++) {
+    for(int x = 0; x < _width; x++) {
+      const Vector<3, uc>& px = image.at<Vector<3, uc> >(y, x);
+      for(int i = 0; i < 3; i++) {
+        _from[(y * _width + x) * 3 + i] = px[i];
+      }
+    }
+  }
+
+  /* the noise of each pixel is guessed from its neighbors first, each pass
+   * then tells how much of it the pass took out */
+  current = this;
+  for(int k = -1; k < passes; k++) {
+    _step = k < 0 ? 0 : 1 << k;
+    _next = 0;
+
+#ifdef DEBUG
+    work();
+#else
+    pool::workers().start(work);
+    pool::workers().wait();
+#endif
+
+    if(k >= 0) {
+      _from.swap(_to);
+    }
+    _var.swap(_var_to);
+  }
+  current = NULL;
+
+  for(int y = 0; y < _height; y++) {
+    for(int x = 0; x < _width; x++) {
+      Vector<3, uc>& px = image.at<Vector<3, uc> >(y, x);
+      for(int i = 0; i < 3; i++) {
+        px[i] = uc(min(max(_from[(y * _width + x) * 3 + i] + 0.5f, 0.0f), 255.0f));
+      }
+    }
+  }
+
+  _time = (trace::now() - start) / 1e6;
+}
+
+/**
+ * The job run by each thread of the worker pool, filters tiles of the current
+ * pass until every tile has been claimed.
+ */
+void denoiser::work() {
+  denoiser* d = current;
+  int tiles = ((d->_width + TILE - 1) / TILE) * ((d->_height + TILE - 1) / TILE);
+  int tile;
+
+  while((tile = d->_next.fetch_add(1)) < tiles) {
+    if(d->_step == 0) {
+      d->estimate(tile);
+    } else {
+      d->pass(tile);
+    }
+  }
+}
+
+/**
+ * How far apart two pixels are in their guides alone. The weight of the other
+ * pixel is e to the minus this, the normals count for about the cosine of the
+ * angle between them to the power of normal.
+ *
+ * @param g the guide of the pixel being filtered
+ * @param h the guide of the other pixel
+ * @param plane one over the distance off the plane of g that cuts the weight by e
+ * @return the distance, less than 0 if the pixels must not be mixed
+ */
+inline float denoiser::apart(const guide& g, const guide& h, float plane) const {
+  if(h.material != g.material) {
+    return -1;
+  }
+
+  float cos = g.n[0] * h.n[0] + g.n[1] * h.n[1] + g.n[2] * h.n[2];
+  if(cos <= 0) {
+    return -1;
+  }
+
+  float off = std::fabs(g.n[0] * (h.p[0] - g.p[0]) + g.n[1] * (h.p[1] - g.p[1]) +
+      g.n[2] * (h.p[2] - g.p[2]));
+  return float(normal) * (1 - cos) + off * plane;
+}
+
+/**
+ * Guesses the noise of each pixel of a tile as the variance of the brightness
+ * of the pixels around it that are on the same surface.
+ *
+ * @param tile the index of the tile, in rows of tiles across the image
+ */
+void denoiser::estimate(int tile) {
+  int across = (_width + TILE - 1) / TILE;
+  int x0 = (tile % across) * TILE, y0 = (tile / across) * TILE;
+  int x1 = min(x0 + TILE, _width), y1 = min(y0 + TILE, _height);
+
+  for(int y = y0; y < y1; y++) {
+    for(int x = x0; x < x1; x++) {
+      int idx = y * _width + x;
+      const guide& g = _guides[idx];
+      if(g.material < 0) {
+        _var_to[idx] = 0;
+        continue;
+      }
+
+      float plane = 1.0f / (depth * g.foot), sum = 0, sq = 0, total = 0;
+      for(int qy = max(y - RADIUS, 0); qy <= min(y + RADIUS, _height - 1); qy++) {
+        for(int qx = max(x - RADIUS, 0); qx <= min(x + RADIUS, _width - 1); qx++) {
+          int q = qy * _width + qx;
+          float d = apart(g, _guides[q], plane);
+          if(d < 0) {
+            continue;
+          }
+
+          float w = std::exp(-d), l = luma(&_from[q * 3]);
+          sum += w * l;
+          sq += w * l * l;
+          total += w;
+        }
+      }
+
+      sum /= total;
+      _var_to[idx] = max(sq / total - sum * sum, 0.0f);
+    }
+  }
+}
+
+/**
+ * Filters one tile for the current pass, reading _from and writing _to.
+ *
+ * @param tile the index of the tile, in rows of tiles across the image
+ */
+void denoiser::pass(int tile) {
+  int across = (_width + TILE - 1) / TILE;
+  int x0 = (tile % across) * TILE, y0 = (tile / across) * TILE;
+  int x1 = min(x0 + TILE, _width), y1 = min(y0 + TILE, _height);
+
+  for(int y = y0; y < y1; y++) {
+    for(int x = x0; x < x1; x++) {
+      int idx = y * _width + x;
+      const guide& g = _guides[idx];
+      const float* c = &_from[idx * 3];
+
+      if(g.material < 0) {
+        std::copy(c, c + 3, &_to[idx * 3]);
+        _var_to[idx] = _var[idx];
+        continue;
+      }
+
+      /* a pixel without noise still mixes with pixels a level of the image apart */
+      float plane = 1.0f / (depth * g.foot * _step), l = luma(c);
+      float bright = 1.0f / (sigma * std::sqrt(_var[idx]) + 1.0f);
+      float sum[3] = { 0, 0, 0 }, var = 0, total = 0;
+      for(int j = 0; j < 5; j++) {
+        int qy = y + (j - 2) * _step;
+        if(qy < 0 || qy >= _height) {
+          continue;
+        }
+
+        for(int i = 0; i < 5; i++) {
+          int qx = x + (i - 2) * _step;
+          if(qx < 0 || qx >= _width) {
+            continue;
+          }
+
+          int q = qy * _width + qx;
+          float d = apart(g, _guides[q], plane);
+          if(d < 0) {
+            continue;
+          }
+
+          const float* o = &_from[q * 3];
+          float w = kernel[i] * kernel[j] * std::exp(-d - std::fabs(luma(o) - l) * bright);
+
+          sum[0] += w * o[0];
+          sum[1] += w * o[1];
+          sum[2] += w * o[2];
+          var += w * w * _var[q];
+          total += w;
+        }
+      }
+
+      for(int k = 0; k < 3; k++) {
+        _to[idx * 3 + k] = sum[k] / total;
+      }
+      _var_to[idx] = var / (total * total);
+    }
+  }
+}
+
+/**
+ * Prints how much of the image was filtered and how long it took.
+ */
+void denoiser::report() const {
+  cout << "denoise: " << _width << "x" << _height << ", " << passes << " passes, "
+       << 100.0 * _mixed / _guides.size() << "% of pixels filtered, " << _time << " ms" << endl;
+}
@@ -0,0 +1,95 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef DENOISER_H_INCLUDE
+#define DENOISER_H_INCLUDE
+
+#include <gbuffer.h>
+
+#include <atomic>
+#include <vector>
+using std::vector;
+
+#include <cv.h>
+
+class camera;
+
+/**
+ * Smooths the noise left by sampling the lights, see light_tree::samples, out
+ * of a finished image. The filter is an edge avoiding a-trous wavelet: each
+ * pass blurs with a 5x5 kernel whose taps are twice as far apart as in the
+ * pass before, so a few passes cover a wide area at the cost of 25 taps a
+ * pixel each. The weight of a tap is cut down by how much the two pixels
+ * differ in:
+ *   1. material: pixels of different materials are never mixed.
+ *   2. normal: the normals of the first hits, so creases stay sharp.
+ *   3. depth: how far the tap lies off the plane of the pixel, measured in
+ *      pixel footprints, so silhouettes stay sharp.
+ *   4. brightness: measured against the noise of the pixel, so what the
+ *      guides cannot see, such as shadows and reflections, is kept where
+ *      it stands out of the noise. The noise is guessed from the variance of
+ *      the pixels around it on the same surface before the first pass, and
+ *      each pass works out how much of it is left.
+ *
+ * The guides come from the first hit of each pixel kept in the camera's
+ * gbuffer, so only click() and reshade() can be denoised. Pixels whose
+ * primary ray missed, or never finished, are left as they are. The image is
+ * cut into tiles that the worker pool filters in parallel, one pass at a
+ * time.
+ *
+ * @file denoiser.h
+ */
+class denoiser {
+  public:
+
+    denoiser(const camera* c, const gbuffer& g, int width, int height);
+    virtual ~denoiser() { }
+
+    void filter(cv::Mat& image);
+    void report() const;
+
+    static int    passes;
+    static double sigma;
+    static double normal;
+    static double depth;
+
+  protected:
+
+    /** what the first hit of a pixel looks like */
+    struct guide {
+      float n[3];     ///< the normal facing the camera
+      float p[3];     ///< the point hit
+      float foot;     ///< the width of the pixel at p
+      int   material; ///< index of the material, -1 if the ray missed
+    };
+
+    static const int TILE   = 32;  ///< pixels along each side of a tile
+    static const int RADIUS = 2;   ///< how far the noise of a pixel is looked for
+
+    float apart(const guide& g, const guide& h, float plane) const;
+    void estimate(int tile);
+    void pass(int tile);
+    static void work();
+
+    int                _width;   ///< width of the image in pixels
+    int                _height;  ///< height of the image in pixels
+    vector<guide>      _guides;  ///< the guide of each pixel
+    vector<float>      _from;    ///< the colors read by the current pass
+    vector<float>      _to;      ///< the colors written by the current pass
+    vector<float>      _var;     ///< the noise left in each pixel of _from
+    vector<float>      _var_to;  ///< the noise left in each pixel of _to
+    int                _step;    ///< distance between taps in this pass, 0 to estimate the noise
+    std::atomic<int>   _next;    ///< the next tile of the pass to filter
+    unsigned long      _mixed;   ///< pixels that were filtered
+    double             _time;    ///< time taken to filter in ms
+};
+
+#endif /* DENOISER_H_INCLUDE */
@@ -0,0 +1,129 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <display.h>
+#include <trace.h>
+
+#include <algorithm>
+using std::max;
+#include <chrono>
+#include <cstring>
+#include <iostream>
+using std::cout;
+using std::endl;
+#include <thread>
+
+#include <highgui.h>
+
+/* intialize statics */
+int display::fps = 30;
+
+/**
+ * Creates a display for an image, nothing is shown until run() is called.
+ *
+ * @param image the image, its pixels are written as the bands finish
+ * @param window the name of the window to show it in
+ * @param bands the number of bands the image is rendered in
+ */
+display::display(cv::Mat& image, const string& window, int bands) :
+    _image(image), _window(window), _dirty(NULL), _bands(bands), _copied(0), _frames(0),
+    _idle(0), _bytes(0), _time(0), _start(trace::now()), _first(0), _live(NULL) { }
+
+/**
+ * Called by the last ray of a band, pushes the band onto the list of finished
+ * bands. This never blocks.
+ *
+ * @param b the band that finished
+ */
+void display::finish(image_band* b) {
+  image_band* head = _dirty.load(std::memory_order_relaxed);
+  do {
+    b->next = head;
+  } while(!_dirty.compare_exchange_weak(head, b, std::memory_order_release,
+      std::memory_order_relaxed));
+}
+
+/**
+ * Takes every band that finished since the last call, copies its rows into
+ * the image and frees it unless the bands are watched. Watched bands are
+ * copied whether they have finished or not.
+ *
+ * @return true if any rows were copied
+ */
+bool display::update() {
+  if(_live != NULL) {
+    for(auto iter = _live->begin(); iter != _live->end(); iter++) {
+      if((*iter)->remaining.load(std::memory_order_relaxed) != 0) {
+        unsigned long size = (*iter)->pixels.size() * sizeof((*iter)->pixels[0]);
+        memcpy(_image.ptr((*iter)->first), &(*iter)->pixels[0], size);
+        _bytes += size;
+      }
+    }
+  }
+
+  image_band* b = _dirty.exchange(NULL, std::memory_order_acquire);
+  bool any = b != NULL;
+
+  if(any && _first == 0) {
+    _first = trace::now();
+  }
+
+  while(b != NULL) {
+    image_band* next = b->next;
+    unsigned long size = b->pixels.size() * sizeof(b->pixels[0]);
+    memcpy(_image.ptr(b->first), &b->pixels[0], size);
+    _bytes += size;
+    _copied++;
+    if(_live == NULL) {
+      delete b;
+    }
+    b = next;
+  }
+
+  return any || _live != NULL;
+}
+
+/**
+ * Shows the image until every band has finished, at most fps frames a second.
+ * A frame is only drawn when a band finished since the last one. Returns once
+ * the whole image has been copied.
+ */
+void display::run() {
+  std::chrono::nanoseconds frame(1000000000 / max(fps, 1));
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+  while(_copied < _bands) {
+    next += frame;
+    std::this_thread::sleep_until(next);
+
+    trace_span span("display");
+    long long start = trace::now();
+    if(update()) {
+      cv::imshow(_window, _image);
+      _frames++;
+    } else {
+      _idle++;
+    }
+    cv::waitKey(1);
+    _time += trace::now() - start;
+  }
+}
+
+/**
+ * Prints how much work the display did.
+ */
+void display::report() const {
+  double mb = 1024.0 * 1024.0;
+  cout << "display: " << _frames << " frames at most " << fps << " per second, " << _idle
+       << " skipped, " << _copied << " bands, copied " << _bytes / mb << " MiB ("
+       << double(_image.rows) * _image.cols * 3 * _frames / mb << " MiB as whole frames), "
+       << _time / 1e6 << " ms, first band after " << (_first - _start) / 1e6 << " ms" << endl;
+}
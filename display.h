@@ -0,0 +1,72 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef DISPLAY_H_INCLUDE
+#define DISPLAY_H_INCLUDE
+
+#include <image_writer.h>
+
+#include <atomic>
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+
+#include <cv.h>
+
+/**
+ * Shows an image in a window while it is rendered. The rays write into bands
+ * of their own instead of the image on screen, and the last ray of a band
+ * pushes it onto a lock free list of finished bands. The display thread takes
+ * the whole list at once, copies only those rows into the image and shows it,
+ * at most fps times a second. Rays never wait on the display and the display
+ * never reads a pixel that is still being written.
+ *
+ * When the rays are not traced band by band every band finishes near the
+ * end. The caller can then have the display watch all of the bands, each
+ * frame also copies the ones that have not finished yet. Such a frame may
+ * show a pixel between two bounces, the final image is only copied once the
+ * band has finished. Watched bands are freed by the caller.
+ *
+ * @file display.h
+ */
+class display : public band_sink {
+  public:
+
+    display(cv::Mat& image, const string& window, int bands);
+    virtual ~display() { }
+
+    virtual void finish(image_band* b);
+    inline void watch(const vector<image_band*>* bands) { _live = bands; }
+    void run();
+    void report() const;
+
+    static int fps;
+
+  protected:
+
+    bool update();
+
+    cv::Mat&                 _image;   ///< the whole image, only written by the display thread
+    string                   _window;  ///< the window the image is shown in
+    std::atomic<image_band*> _dirty;   ///< finished bands that have not been copied yet
+    int                      _bands;   ///< bands in the image
+    int                      _copied;  ///< bands copied into the image
+    int                      _frames;  ///< times the image was shown
+    int                      _idle;    ///< frames skipped because nothing had finished
+    unsigned long            _bytes;   ///< bytes copied into the image
+    long long                _time;    ///< time spent copying and showing in ns
+    long long                _start;   ///< when the display was created
+    long long                _first;   ///< when the first band was copied, 0 until then
+    const vector<image_band*>* _live;  ///< every band, copied each frame while unfinished, NULL if not watched
+};
+
+#endif /* DISPLAY_H_INCLUDE */
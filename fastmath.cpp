@@ -0,0 +1,46 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <fastmath.h>
+
+/* intialize statics */
+fastmath::tier fastmath::mode = fastmath::exact;
+
+/**
+ * Selects the accuracy of the shading math.
+ *
+ * @param name one of "exact", "fast" or "approx"
+ * @return false if the name is not a known tier
+ */
+bool fastmath::parse(const string& name) {
+  for(int t = exact; t <= approx; t++) {
+    if(name == fastmath::name(tier(t))) {
+      mode = tier(t);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @param t an accuracy tier
+ * @return the name used for the tier on the command line
+ */
+const char* fastmath::name(tier t) {
+  switch(t) {
+    case exact:  return "exact";
+    case fast:   return "fast";
+    case approx: return "approx";
+  }
+
+  return "";
+}
@@ -0,0 +1,201 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef FASTMATH_H_INCLUDE
+#define FASTMATH_H_INCLUDE
+
+#include <Vector.tpp>
+
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+using std::string;
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/**
+ * The math used while shading a hit, with three levels of accuracy:
+ *
+ *   exact:  the standard library, the image is the same as without this layer
+ *   fast:   integer powers by repeated squaring, within a few ulps of
+ *           std::pow. Vectors are normalized exactly as in exact, since the
+ *           reflected, refracted and shadow rays are made from them and a
+ *           direction that is off by an ulp can hit a different surface.
+ *           Every ray hits what it does in exact, only the highlights can
+ *           differ, by a few ulps before they are rounded to 8 bits.
+ *   approx: a hardware reciprocal square root refined with one Newton step
+ *           and a polynomial log2/exp2 power, relative error around 1e-6 per
+ *           operation. The ray directions change with it, so a ray that
+ *           grazes an edge can hit something else and that pixel can be off
+ *           by anything, see --math-report.
+ *
+ * The level is chosen once before rendering, every call checks it so the
+ * branch is always predicted.
+ *
+ * @file fastmath.h
+ */
+class fastmath {
+  public:
+
+    /** the accuracy levels */
+    enum tier { exact, fast, approx };
+
+    static bool parse(const string& name);
+    static const char* name(tier t);
+
+    static inline double pow(double x, double a);
+    static inline double rsqrt(double x);
+    static inline double length(const Vector<3>& v);
+    static inline void normalize(Vector<3>& v);
+
+    static tier mode;
+
+  protected:
+
+    static inline double ipow(double x, unsigned int a);
+    static inline double log2(double x);
+    static inline double exp2(double y);
+};
+
+/**
+ * Raises x to the power a, x is never negative when shading.
+ */
+inline double fastmath::pow(double x, double a) {
+  if(mode == exact) {
+    return std::pow(x, a);
+  }
+
+  if(mode == fast) {
+    if(a >= 0 && a <= 1024 && a == double((unsigned int)a)) {
+      return ipow(x, (unsigned int)a);
+    }
+    return std::pow(x, a);
+  }
+
+  if(x < DBL_MIN) {
+    return std::pow(x, a);
+  }
+  return exp2(a * log2(x));
+}
+
+/**
+ * Calculates 1/sqrt(x).
+ */
+inline double fastmath::rsqrt(double x) {
+  if(mode != approx) {
+    return 1.0 / std::sqrt(x);
+  }
+
+#ifdef __SSE__
+  double y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(float(x))));
+  return y * (1.5 - 0.5 * x * y * y);
+#else
+  return 1.0 / std::sqrt(x);
+#endif
+}
+
+/**
+ * @return the length of v
+ */
+inline double fastmath::length(const Vector<3>& v) {
+  if(mode != approx) {
+    return v.length();
+  }
+
+  return std::sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+}
+
+/**
+ * Normalizes v in place. A zero Vector is left alone, the same as
+ * Vector::normalize().
+ */
+inline void fastmath::normalize(Vector<3>& v) {
+  if(mode != approx) {
+    v.normalize();
+    return;
+  }
+
+  double sq = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+  if(sq == 0) {
+    return;
+  }
+
+  double inv = rsqrt(sq);
+  v[0] *= inv;
+  v[1] *= inv;
+  v[2] *= inv;
+}
+
+/**
+ * Raises x to a whole power by repeated squaring.
+ */
+inline double fastmath::ipow(double x, unsigned int a) {
+  double ret = 1;
+
+  for(; a; a >>= 1) {
+    if(a & 1) {
+      ret *= x;
+    }
+    x *= x;
+  }
+
+  return ret;
+}
+
+/**
+ * Approximates log2 of a positive normal number. The mantissa is moved into
+ * [sqrt(1/2), sqrt(2)) and log2 of it is taken from the atanh series.
+ */
+inline double fastmath::log2(double x) {
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+
+  int e = int((bits >> 52) & 0x7ff) - 1023;
+  bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+
+  double m;
+  memcpy(&m, &bits, sizeof(m));
+  if(m > M_SQRT2) {
+    m *= 0.5;
+    e++;
+  }
+
+  double t = (m - 1) / (m + 1), t2 = t * t;
+  double s = t * (2.0 + t2 * (2.0/3 + t2 * (2.0/5 + t2 * (2.0/7))));
+  return e + s * M_LOG2E;
+}
+
+/**
+ * Approximates 2 to the power y. The fraction is taken from a Taylor series
+ * around one half and the whole part is put straight into the exponent.
+ */
+inline double fastmath::exp2(double y) {
+  if(y < -1022) {
+    return 0;
+  } else if(y > 1023) {
+    return HUGE_VAL;
+  }
+
+  double i = std::floor(y);
+  double g = (y - i - 0.5) * M_LN2;
+  double f = 1 + g * (1 + g * (1.0/2 + g * (1.0/6 + g * (1.0/24 + g * (1.0/120 + g * (1.0/720))))));
+
+  uint64_t bits = uint64_t(int(i) + 1023) << 52;
+  double scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return f * M_SQRT2 * scale;
+}
+
+#endif /* FASTMATH_H_INCLUDE */
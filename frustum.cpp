@@ -0,0 +1,206 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <frustum.h>
+#include <camera.h>
+#include <model.h>
+#include <trace.h>
+
+#include <algorithm>
+using std::max;
+using std::min;
+#include <cmath>
+#include <iostream>
+using std::cout;
+using std::endl;
+
+/* intialize statics */
+int frustum::tile = 32;
+
+/**
+ * Builds the list of every tile of a camera's image.
+ *
+ * @param m the model the camera renders
+ * @param c the camera, its image must not change while the lists are used
+ */
+frustum::frustum(const model* m, const camera* c) :
+    _width(c->umax() - c->umin() + 1), _height(c->vmax() - c->vmin() + 1),
+    _across(0), _down(0), _tiles(), _objects(0), _entries(0), _most(0), _full(0), _tested(1),
+    _build(0) {
+  long long start = trace::now();
+  const sphere_list& spheres = m->spheres();
+  const sphere_list& bounds = m->bounds();
+
+  _across  = (_width + tile - 1) / tile;
+  _down    = (_height + tile - 1) / tile;
+  _objects = spheres.size() + bounds.size();
+  if(_objects == 0 || _width <= 0 || _height <= 0) {
+    return;
+  }
+
+  /* find the tiles each sphere and group can be seen in */
+  vector<int> boxes(4 * _objects, 0);
+  vector<bool> seen(_objects, false);
+  vector<int> count(_across * _down, 0);
+  for(int i = 0; i < _objects; i++) {
+    int* box = &boxes[4 * i];
+    bool sphere = i < spheres.size();
+    int k = sphere ? i : i - spheres.size();
+
+    if(!(seen[i] = project(c, sphere ? spheres.center(k) : bounds.center(k),
+        sphere ? spheres.radius(k) : bounds.radius(k), box))) {
+      continue;
+    }
+    for(int j = 0; j < 4; j++) {
+      box[j] /= tile;
+    }
+    for(int y = box[2]; y <= box[3]; y++) {
+      for(int x = box[0]; x <= box[1]; x++) {
+        count[y * _across + x]++;
+      }
+    }
+  }
+
+  /* tiles that see more than half of the model are not worth a list */
+  unsigned long entries = 0;
+  double tested = 0;
+  for(unsigned int t = 0; t < count.size(); t++) {
+    int pixels = (min(int(t % _across + 1) * tile, _width) - int(t % _across) * tile) *
+        (min(int(t / _across + 1) * tile, _height) - int(t / _across) * tile);
+
+    if(count[t] * 2 > _objects) {
+      tested += double(pixels) * _objects;
+      _full++;
+    } else {
+      tested += double(pixels) * count[t];
+      entries += count[t];
+      _most = max(_most, count[t]);
+    }
+  }
+
+  /* the lists may not grow much larger than the model */
+  if(entries > 8ul * _objects + (1ul << 20)) {
+    _full = count.size();
+    _most = 0;
+    _build = (trace::now() - start) / 1e6;
+    return;
+  }
+
+  _entries = entries;
+  _tested  = tested / (double(_width) * _height * _objects);
+  _tiles.resize(count.size(), NULL);
+  for(unsigned int t = 0; t < count.size(); t++) {
+    if(count[t] * 2 <= _objects) {
+      _tiles[t] = new cull_list;
+    }
+  }
+
+  for(int i = 0; i < _objects; i++) {
+    const int* box = &boxes[4 * i];
+    bool sphere = i < spheres.size();
+    int k = sphere ? i : i - spheres.size();
+
+    if(!seen[i]) {
+      continue;
+    }
+    for(int y = box[2]; y <= box[3]; y++) {
+      for(int x = box[0]; x <= box[1]; x++) {
+        cull_list* l = _tiles[y * _across + x];
+        if(l == NULL) {
+          continue;
+        }
+        if(sphere) {
+          l->spheres.push_back(spheres.center(k), spheres.radius(k));
+          l->sphere_index.push_back(k);
+        } else {
+          l->bounds.push_back(bounds.center(k), bounds.radius(k));
+          l->bound_index.push_back(k);
+        }
+      }
+    }
+  }
+
+  _build = (trace::now() - start) / 1e6;
+}
+
+/**
+ * Frees the lists.
+ */
+frustum::~frustum() {
+  for(auto iter = _tiles.begin(); iter != _tiles.end(); iter++) {
+    delete *iter;
+  }
+}
+
+/**
+ * Projects a sphere onto the image of a camera. The edges of the projection
+ * along u are where the planes through the focal point that hold the v axis
+ * touch the sphere, and the same for v. The box is grown by a pixel on every
+ * side so rounding can never drop a pixel that sees the sphere.
+ *
+ * @param c the camera
+ * @param center the center of the sphere
+ * @param radius the radius of the sphere
+ * @param box set to the first and last column, then first and last row of pixels
+ * @return false if no primary ray can reach the sphere
+ */
+bool frustum::project(const camera* c, const point& center, double radius, int box[4]) {
+  int width = c->umax() - c->umin() + 1, height = c->vmax() - c->vmin() + 1;
+  Vector<3> d = center - c->focal_point();
+  double z = -d.dot(c->n()), a = d.dot(c->u()), b = d.dot(c->v());
+  double fl = c->focal_length();
+
+  /* behind the camera */
+  if(z + radius <= 0) {
+    return false;
+  }
+
+  box[0] = 0; box[1] = width - 1;
+  box[2] = 0; box[3] = height - 1;
+
+  /* around the focal point, it can be anywhere on the image */
+  if(z - radius <= 0 || fl <= 0) {
+    return true;
+  }
+
+  double z2 = z*z - radius*radius;
+  double ra = radius * std::sqrt(a*a + z2), rb = radius * std::sqrt(b*b + z2);
+  double x0 = fl * (a*z - ra) / z2 - c->umin() - 1, x1 = fl * (a*z + ra) / z2 - c->umin() + 1;
+  double y0 = c->vmax() - fl * (b*z + rb) / z2 - 1, y1 = c->vmax() - fl * (b*z - rb) / z2 + 1;
+
+  if(x1 < 0 || x0 >= width || y1 < 0 || y0 >= height) {
+    return false;
+  }
+
+  box[0] = int(max(x0, 0.0)); box[1] = int(min(x1, width - 1.0));
+  box[2] = int(max(y0, 0.0)); box[3] = int(min(y1, height - 1.0));
+  return true;
+}
+
+/**
+ * Prints how much the lists cull.
+ */
+void frustum::report() const {
+  unsigned long bytes = _tiles.size() * sizeof(cull_list*);
+  for(auto iter = _tiles.begin(); iter != _tiles.end(); iter++) {
+    if(*iter != NULL) {
+      bytes += sizeof(cull_list) + (*iter)->spheres.bytes() + (*iter)->bounds.bytes() +
+          ((*iter)->sphere_index.capacity() + (*iter)->bound_index.capacity()) * sizeof(int);
+    }
+  }
+
+  int tiles = _across * _down;
+  cout << "cull: " << tiles << " tiles of " << tile << "x" << tile << ", " << _full
+       << " test the whole model, lists hold " << double(_entries) / max(tiles - _full, 1)
+       << " of " << _objects << " spheres and groups on average, at most " << _most
+       << "; primary rays test " << 100 * _tested << "% of the model, " << bytes / 1024
+       << " KiB, built in " << _build << " ms" << endl;
+}
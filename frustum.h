@@ -0,0 +1,82 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef FRUSTUM_H_INCLUDE
+#define FRUSTUM_H_INCLUDE
+
+#include <sphere_list.h>
+
+#include <vector>
+using std::vector;
+
+class camera;
+class model;
+
+/**
+ * Part of a model: copies of some of its spheres and of the bounds of some of
+ * its groups of polygons, with the index of each in the model.
+ */
+struct cull_list {
+  sphere_list spheres;       ///< the spheres
+  vector<int> sphere_index;  ///< the index of each sphere in the model
+  sphere_list bounds;        ///< the bounds of the groups of polygons
+  vector<int> bound_index;   ///< the index of each group in the model
+};
+
+/**
+ * Per tile lists of what the primary rays of a camera can hit. The image is
+ * cut into square tiles and the bounding sphere of every sphere and group of
+ * polygons is projected onto it, each tile keeps a list of the ones whose
+ * projection touches it. The primary rays of a tile only test that list.
+ *
+ * A tile that sees more than half of the model keeps no list and its rays
+ * test the whole model. If the lists would be much larger than the model no
+ * lists are kept at all.
+ *
+ * @file frustum.h
+ */
+class frustum {
+  public:
+
+    frustum(const model* m, const camera* c);
+    virtual ~frustum();
+
+    /**
+     * @param pixel the index of a pixel of the image
+     * @return what the pixel's tile can see, NULL if it must test the whole model
+     */
+    inline const cull_list* operator[](int pixel) const {
+      return _tiles.empty() ? NULL : _tiles[(pixel / _width / tile) * _across + (pixel % _width) / tile];
+    }
+
+    void report() const;
+
+    static bool project(const camera* c, const point& center, double radius, int box[4]);
+
+    static int tile;
+
+  protected:
+
+    int                _width;   ///< width of the image in pixels
+    int                _height;  ///< height of the image in pixels
+    int                _across;  ///< tiles in a row
+    int                _down;    ///< tiles in a column
+    vector<cull_list*> _tiles;   ///< the list of each tile, NULL for tiles that see too much
+
+    int           _objects;  ///< spheres and groups of polygons in the model
+    unsigned long _entries;  ///< spheres and groups in every list
+    int           _most;     ///< largest list
+    int           _full;     ///< tiles without a list
+    double        _tested;   ///< fraction of the model a primary ray tests on average
+    double        _build;    ///< time taken to build the lists in ms
+};
+
+#endif /* FRUSTUM_H_INCLUDE */
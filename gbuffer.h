@@ -0,0 +1,60 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef GBUFFER_H_INCLUDE
+#define GBUFFER_H_INCLUDE
+
+#include <surface.h>
+#include <Vector.tpp>
+
+#include <vector>
+using std::vector;
+
+/**
+ * What the primary ray of each pixel hit: the surface, the point and normal
+ * there and the index of its material. The buffer is filled while an image is
+ * rendered, once it is ready a camera shades from it instead of tracing the
+ * primary rays again. Only the material index is kept, so lights and the
+ * parameters of materials can change between renders but the geometry and
+ * the camera cannot.
+ *
+ * @file gbuffer.h
+ */
+class gbuffer {
+  public:
+
+    /** the first hit of a single pixel */
+    struct sample {
+      hit       h;         ///< the surface, hit::none if the ray missed
+      point     p;         ///< where the surface was hit
+      Vector<3> n;         ///< the normal of the surface at p
+      int       material;  ///< index of the material of the surface
+    };
+
+    gbuffer(int width, int height) :
+      _samples(width * height), _ready(false) { }
+    virtual ~gbuffer() { }
+
+    inline sample& operator[](int i) { return _samples[i]; }
+    inline const sample& operator[](int i) const { return _samples[i]; }
+    inline bool& ready() { return _ready; }
+    inline bool ready() const { return _ready; }
+    inline unsigned long bytes() const { return _samples.capacity() * sizeof(sample); }
+
+    static bool enabled;
+
+  protected:
+
+    vector<sample> _samples;  ///< one sample per pixel
+    bool           _ready;    ///< every sample has been filled in
+};
+
+#endif /* GBUFFER_H_INCLUDE */
@@ -0,0 +1,156 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <heatmap.h>
+#include <Vector.tpp>
+
+#include <algorithm>
+using std::max;
+using std::min;
+#include <cmath>
+#include <iostream>
+using std::cout;
+using std::endl;
+
+#include <cv.h>
+#include <highgui.h>
+
+#define SCALE_WIDTH 16
+#define SCALE_GAP   4
+
+/* intialize statics */
+heatmap::metric             heatmap::mode          = heatmap::none;
+thread_local unsigned long heatmap::intersections = 0;
+thread_local unsigned long heatmap::shadow_rays   = 0;
+
+/**
+ * The colour scale used for the heatmap, from cheap to expensive. Colours are
+ * in the blue, green, red order that opencv uses.
+ */
+static const double scale[][3] = {
+  {   0,   0,   0 },
+  { 128,   0,  32 },
+  { 160,  32, 160 },
+  {  32,  64, 240 },
+  {   0, 200, 255 },
+  { 255, 255, 255 }
+};
+static const int scale_size = sizeof(scale) / sizeof(scale[0]);
+
+/**
+ * Maps a value in the range [0, 1] onto the colour scale.
+ *
+ * @param t the value to map
+ * @return the colour of the value
+ */
+static Vector<3, unsigned char> colour(double t) {
+  Vector<3, unsigned char> ret;
+  double pos = min(max(t, 0.0), 1.0) * (scale_size - 1);
+  int lo = min(int(pos), scale_size - 2);
+  double f = pos - lo;
+
+  for(int i = 0; i < 3; i++) {
+    ret[i] = (unsigned char)(scale[lo][i] * (1 - f) + scale[lo + 1][i] * f + 0.5);
+  }
+
+  return ret;
+}
+
+/**
+ * Selects the metric that the heatmap will measure.
+ *
+ * @param name one of "tests", "bounces", "shadows" or "time"
+ * @return false if the name is not a known metric
+ */
+bool heatmap::parse(const string& name) {
+  for(int m = tests; m <= time; m++) {
+    if(name == heatmap::name(metric(m))) {
+      mode = metric(m);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @param m the metric
+ * @return the name used for the metric on the command line
+ */
+const char* heatmap::name(metric m) {
+  switch(m) {
+    case tests:   return "tests";
+    case bounces: return "bounces";
+    case shadows: return "shadows";
+    case time:    return "time";
+    default:      return "none";
+  }
+}
+
+/**
+ * Writes the heatmap as a false colour image. The costs are mapped onto the
+ * colour scale logarithmically since a few pixels usually cost orders of
+ * magnitude more than the rest. The colour scale itself is drawn along the
+ * right edge of the image, cheapest at the bottom.
+ *
+ * @param filename the file to write the image to
+ * @return true if the image was written
+ */
+bool heatmap::write(const string& filename) const {
+  cv::Mat image(_height, _width + SCALE_GAP + SCALE_WIDTH, CV_8UC3);
+  double lo = _cost[0], hi = _cost[0], total = 0;
+
+  for(auto iter = _cost.begin(); iter != _cost.end(); iter++) {
+    lo = min(lo, *iter);
+    hi = max(hi, *iter);
+    total += *iter;
+  }
+
+  double range = log1p(hi - lo);
+  for(int y = 0; y < _height; y++) {
+    for(int x = 0; x < _width; x++) {
+      double t = range == 0 ? 0 : log1p(_cost[y * _width + x] - lo) / range;
+      image.at<Vector<3, unsigned char> >(y, x) = colour(t);
+    }
+
+    for(int x = _width; x < _width + SCALE_GAP; x++) {
+      image.at<Vector<3, unsigned char> >(y, x) = Vector<3, unsigned char>(0);
+    }
+
+    for(int x = _width + SCALE_GAP; x < _width + SCALE_GAP + SCALE_WIDTH; x++) {
+      image.at<Vector<3, unsigned char> >(y, x) =
+          colour(_height == 1 ? 1 : 1 - double(y) / (_height - 1));
+    }
+  }
+
+  cout << "cost heatmap (" << name(mode) << "): min " << lo << ", max " << hi
+       << ", mean " << total / _cost.size() << ", log scale, written to "
+       << filename << endl;
+
+  return cv::imwrite(filename, image);
+}
+
+/**
+ * Adds the work done since construction to the pixel.
+ */
+heatmap_span::~heatmap_span() {
+  if(_map == NULL) {
+    return;
+  }
+
+  switch(heatmap::mode) {
+    case heatmap::tests:   (*_map)[_index] += heatmap::intersections - _tests; break;
+    case heatmap::bounces: (*_map)[_index] += 1;                               break;
+    case heatmap::shadows: (*_map)[_index] += heatmap::shadow_rays - _shadows; break;
+    case heatmap::time:    (*_map)[_index] += trace::now() - _start;           break;
+    default: break;
+  }
+}
@@ -0,0 +1,87 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef HEATMAP_H_INCLUDE
+#define HEATMAP_H_INCLUDE
+
+#include <trace.h>
+
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+
+/**
+ * Keeps track of how much work was spent on every pixel of an image. Once the
+ * image is finished the costs can be written as a false colour image so that
+ * the expensive parts of a scene can be seen. Only one ray works on a pixel at
+ * a time, so the per pixel costs do not need to be protected.
+ *
+ * The work counters are thread local, the intersection and shadow routines
+ * increment them and the heatmap_span that wraps each bounce attributes the
+ * difference to the pixel of the ray.
+ *
+ * @file heatmap.h
+ */
+class heatmap {
+  public:
+
+    /** the type of work that is measured */
+    enum metric { none, tests, bounces, shadows, time };
+
+    heatmap(int width, int height) :
+      _width(width), _height(height), _cost(width * height, 0.0) { }
+    virtual ~heatmap() { }
+
+    inline int width() const { return _width; }
+    inline int height() const { return _height; }
+    inline double& operator[](int i) { return _cost[i]; }
+    inline double operator[](int i) const { return _cost[i]; }
+
+    bool write(const string& filename) const;
+
+    static bool parse(const string& name);
+    static const char* name(metric m);
+
+    static metric mode;
+    static thread_local unsigned long intersections;
+    static thread_local unsigned long shadow_rays;
+
+  protected:
+
+    int            _width;  ///< width of the image in pixels
+    int            _height; ///< height of the image in pixels
+    vector<double> _cost;   ///< the work spent on each pixel
+};
+
+/**
+ * Adds the work done during the lifetime of the object to one pixel of a
+ * heatmap. A NULL heatmap makes this do nothing.
+ */
+class heatmap_span {
+  public:
+
+    heatmap_span(heatmap* map, int index) :
+      _map(map), _index(index),
+      _tests(heatmap::intersections), _shadows(heatmap::shadow_rays),
+      _start(map && heatmap::mode == heatmap::time ? trace::now() : 0) { }
+    ~heatmap_span();
+
+  protected:
+
+    heatmap*      _map;
+    int           _index;
+    unsigned long _tests;
+    unsigned long _shadows;
+    long long     _start;
+};
+
+#endif /* HEATMAP_H_INCLUDE */
@@ -0,0 +1,203 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <image_writer.h>
+#include <trace.h>
+
+#include <algorithm>
+using std::max;
+#include <cstdio>
+#include <iostream>
+using std::cerr;
+using std::endl;
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* intialize statics */
+string image_writer::file      = "";
+int    image_writer::band_rows = 16;
+
+/**
+ * Called by each ray of the band when it finishes, the last one hands the band
+ * to the writer.
+ */
+void image_band::finish() {
+  if(--remaining == 0) {
+    owner->finish(this);
+  }
+}
+
+/**
+ * Creates the file, writes its header and starts the encoder.
+ *
+ * @param filename the file to write
+ * @param width the width of the image
+ * @param height the height of the image
+ * @param limit the most bands that can be rendered at once
+ */
+image_writer::image_writer(const string& filename, int width, int height, int limit) :
+    _filename(filename), _format(ppm), _fd(-1), _header(0), _width(width), _height(height),
+    _done(), _thread(NULL), _in_flight(0), _limit(max(limit, 1)), _closed(false), _bytes(0), _peak(0) {
+  char header[64];
+  long size;
+
+  if(filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".pfm") == 0) {
+    _format = pfm;
+    _header = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+    size = _header + long(width) * height * 3 * sizeof(float);
+  } else {
+    _header = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    size = _header + long(width) * height * 3;
+  }
+
+  _fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(_fd < 0 || pwrite(_fd, header, _header, 0) != _header || ftruncate(_fd, size) != 0) {
+    cerr << "ERROR: could not create image: " << filename << endl;
+    if(_fd >= 0) {
+      ::close(_fd);
+      _fd = -1;
+    }
+    return;
+  }
+
+  _thread = new std::thread(&image_writer::encode, this);
+}
+
+image_writer::~image_writer() {
+  close();
+}
+
+/**
+ * Creates a new band, waiting until there is room for it.
+ *
+ * @param first the first row of the band
+ * @param rows the number of rows in the band
+ * @return the band
+ */
+image_band* image_writer::start(int first, int rows) {
+  std::unique_lock<std::mutex> ul(_lock);
+  long long start = trace::enabled ? trace::now() : 0;
+
+  while(_in_flight >= _limit) {
+    _room.wait(ul);
+  }
+  if(trace::enabled) trace::record("band wait", start, first);
+
+  _in_flight++;
+  _bytes += (unsigned long)rows * _width * sizeof(Vector<3, unsigned char>);
+  _peak = max(_peak, _bytes);
+  return new image_band(this, first, rows, _width);
+}
+
+/**
+ * Queues a band that is finished to be written.
+ *
+ * @param b the band
+ */
+void image_writer::finish(image_band* b) {
+  std::unique_lock<std::mutex> ul(_lock);
+  _done.push_back(b);
+  _work.notify_one();
+}
+
+/**
+ * Waits for every band that was started to be written, then closes the file.
+ */
+void image_writer::close() {
+  if(_thread == NULL) {
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> ul(_lock);
+    _closed = true;
+    _work.notify_one();
+  }
+
+  _thread->join();
+  delete _thread;
+  _thread = NULL;
+
+  ::close(_fd);
+}
+
+/**
+ * The encoder thread, writes bands as they are finished.
+ */
+void image_writer::encode() {
+  trace::thread_name("encoder");
+
+  for(;;) {
+    image_band* b;
+
+    {
+      std::unique_lock<std::mutex> ul(_lock);
+      while(_done.empty() && !(_closed && _in_flight == 0)) {
+        _work.wait(ul);
+      }
+      if(_done.empty()) {
+        return;
+      }
+      b = _done.front();
+      _done.pop_front();
+    }
+
+    write(b);
+
+    {
+      std::unique_lock<std::mutex> ul(_lock);
+      _in_flight--;
+      _bytes -= (unsigned long)b->rows * _width * sizeof(Vector<3, unsigned char>);
+      _room.notify_one();
+    }
+    delete b;
+  }
+}
+
+/**
+ * Converts a band to the format of the file and writes it in place. PPM rows
+ * go from top to bottom and PFM rows from bottom to top.
+ *
+ * @param b the band
+ */
+void image_writer::write(const image_band* b) {
+  trace_span span("encode", b->first);
+
+  if(_format == ppm) {
+    vector<unsigned char> buf(b->pixels.size() * 3);
+    for(unsigned int i = 0; i < b->pixels.size(); i++) {
+      buf[3*i]     = b->pixels[i][2];
+      buf[3*i + 1] = b->pixels[i][1];
+      buf[3*i + 2] = b->pixels[i][0];
+    }
+
+    long offset = _header + long(b->first) * _width * 3;
+    if(pwrite(_fd, &buf[0], buf.size(), offset) != long(buf.size())) {
+      cerr << "ERROR: could not write image: " << _filename << endl;
+    }
+  } else {
+    vector<float> buf(_width * 3);
+    for(int r = 0; r < b->rows; r++) {
+      const Vector<3, unsigned char>* row = &b->pixels[r * _width];
+      for(int x = 0; x < _width; x++) {
+        buf[3*x]     = row[x][2] / 255.0f;
+        buf[3*x + 1] = row[x][1] / 255.0f;
+        buf[3*x + 2] = row[x][0] / 255.0f;
+      }
+
+      long offset = _header + long(_height - 1 - b->first - r) * _width * 3 * sizeof(float);
+      if(pwrite(_fd, &buf[0], buf.size() * sizeof(float), offset) != long(buf.size() * sizeof(float))) {
+        cerr << "ERROR: could not write image: " << _filename << endl;
+      }
+    }
+  }
+}
@@ -0,0 +1,115 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef IMAGE_WRITER_H_INCLUDE
+#define IMAGE_WRITER_H_INCLUDE
+
+#include <Vector.tpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+using std::string;
+#include <thread>
+#include <vector>
+using std::vector;
+
+struct image_band;
+
+/**
+ * Something that is given bands once every ray in them has finished.
+ */
+class band_sink {
+  public:
+    virtual ~band_sink() { }
+    virtual void finish(image_band* b) = 0;
+};
+
+/**
+ * A horizontal band of rows of an image that is being rendered. Every ray of
+ * the band writes into its pixels, the band is handed to its owner once the
+ * last of them has finished.
+ */
+struct image_band {
+  image_band(band_sink* owner, int first, int rows, int width) :
+    owner(owner), first(first), rows(rows), width(width), pixels(rows * width), remaining(rows * width),
+    next(NULL) { }
+
+  void finish();
+
+  band_sink*                       owner;      ///< what the band goes to once it is finished
+  int                              first;      ///< the first row of the image in the band
+  int                              rows;       ///< the number of rows in the band
+  int                              width;      ///< the number of pixels in a row
+  vector<Vector<3, unsigned char> > pixels;    ///< the pixels, blue, green, red like opencv
+  std::atomic<int>                 remaining;  ///< rays that have not finished
+  image_band*                      next;       ///< the next band in the owner's list of finished bands
+};
+
+/**
+ * Writes an image to disk one band at a time while the rest of it is still
+ * being rendered. The file is given its full size when it is opened and each
+ * band is written to its place as soon as it is finished, so the rows that
+ * are done survive a crash and the memory used only depends on the size and
+ * number of bands in flight. Bands are encoded and written on a background
+ * thread.
+ *
+ * The format is picked from the extension of the file name: ".pfm" writes a
+ * floating point PFM, anything else a binary PPM.
+ *
+ * @file image_writer.h
+ */
+class image_writer : public band_sink {
+  public:
+
+    /** the formats that can be written */
+    enum format { ppm, pfm };
+
+    image_writer(const string& filename, int width, int height, int limit);
+    virtual ~image_writer();
+
+    image_band* start(int first, int rows);
+    virtual void finish(image_band* b);
+    void close();
+
+    inline bool ok() const { return _fd >= 0; }
+    inline unsigned long peak() const { return _peak; }
+
+    static string file;
+    static int    band_rows;
+
+  protected:
+
+    void encode();
+    void write(const image_band* b);
+
+    string        _filename;  ///< the file being written
+    format        _format;    ///< the format of the file
+    int           _fd;        ///< the open file
+    long          _header;    ///< size of the header in bytes
+    int           _width;     ///< width of the image in pixels
+    int           _height;    ///< height of the image in pixels
+
+    std::mutex               _lock;      ///< protects everything below
+    std::condition_variable  _work;      ///< signals the encoder that a band is done
+    std::condition_variable  _room;      ///< signals the producer that a band was written
+    std::deque<image_band*>  _done;      ///< finished bands waiting to be written
+    std::thread*             _thread;    ///< the encoder
+    int                      _in_flight; ///< bands started and not yet written
+    int                      _limit;     ///< most bands that can be in flight
+    bool                     _closed;    ///< no more bands will be started
+    unsigned long            _bytes;     ///< memory used by the bands in flight
+    unsigned long            _peak;      ///< most memory ever used by bands in flight
+};
+
+#endif /* IMAGE_WRITER_H_INCLUDE */
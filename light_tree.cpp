@@ -0,0 +1,312 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <light_tree.h>
+#include <model.h>
+
+#include <algorithm>
+using std::max;
+using std::min;
+using std::nth_element;
+using std::sort;
+#include <cmath>
+
+/* intialize statics */
+double light_tree::threshold = 0;
+int    light_tree::samples   = 0;
+
+/**
+ * Hashes a seed into a uniformly distributed number in [0, 1). The sampling
+ * only depends on the pixel and bounce being shaded, so a render is the same
+ * no matter how the work was split between threads.
+ *
+ * @param seed the value to hash
+ * @return a number in [0, 1)
+ */
+double light_tree::uniform(unsigned long long seed) {
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  seed =  seed ^ (seed >> 31);
+  return (seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Compares the positions of two lights along one axis.
+ */
+struct axis_less {
+  axis_less(int axis) : axis(axis) { }
+  bool operator()(const pair<point, int>& lhs, const pair<point, int>& rhs) const {
+    return lhs.first[axis] < rhs.first[axis];
+  }
+  int axis;
+};
+
+/**
+ * Builds the tree over the point lights of a model.
+ *
+ * @param lights the lights of the model
+ */
+light_tree::light_tree(const vector<light>& lights) :
+    _nodes(), _directional(), _power(), _n_point(0) {
+  vector<pair<point, int> > points;
+
+  for(unsigned int i = 0; i < lights.size(); i++) {
+    Vector<3> illum = lights[i].illumination();
+    _power.push_back(max(illum[0], max(illum[1], illum[2])));
+
+    if(lights[i].position()[3] == 0) {
+      _directional.push_back(i);
+    } else {
+      point pos;
+      pos = lights[i].position();
+      points.push_back(pair<point, int>(pos, i));
+    }
+  }
+
+  _n_point = points.size();
+  if(_n_point != 0) {
+    _nodes.reserve(2 * _n_point - 1);
+    build(points, 0, _n_point);
+  }
+}
+
+/**
+ * Recursively builds the tree by splitting the lights at the median of the
+ * longest axis of their bounding box.
+ *
+ * @param lights the positions and indices of the point lights
+ * @param first the first light that belongs under the new node
+ * @param last one past the last light that belongs under the new node
+ * @return the index of the new node
+ */
+int light_tree::build(vector<pair<point, int> >& lights, int first, int last) {
+  int idx = _nodes.size();
+  point lo = lights[first].first, hi = lights[first].first;
+  node nd;
+
+  for(int i = first + 1; i < last; i++) {
+    for(int j = 0; j < 3; j++) {
+      lo[j] = min(lo[j], lights[i].first[j]);
+      hi[j] = max(hi[j], lights[i].first[j]);
+    }
+  }
+
+  nd.center = 0.5 * (lo + hi);
+  nd.radius = 0;
+  nd.power  = 0;
+  nd.max    = 0;
+  for(int i = first; i < last; i++) {
+    nd.radius = max(nd.radius, nd.center.distance(lights[i].first));
+    nd.power += _power[lights[i].second];
+    nd.max    = max(nd.max, _power[lights[i].second]);
+  }
+  /* grow the sphere slightly so rounding can never cull a light */
+  nd.radius = nd.radius * (1 + 1e-9) + 1e-9;
+
+  nd.left = nd.right = nd.light = -1;
+  _nodes.push_back(nd);
+
+  if(last - first == 1) {
+    _nodes[idx].light = lights[first].second;
+    return idx;
+  }
+
+  int axis = 0;
+  for(int j = 1; j < 3; j++) {
+    if(hi[j] - lo[j] > hi[axis] - lo[axis]) {
+      axis = j;
+    }
+  }
+
+  int mid = (first + last) / 2;
+  nth_element(lights.begin() + first, lights.begin() + mid, lights.begin() + last, axis_less(axis));
+
+  int left  = build(lights, first, mid);
+  int right = build(lights, mid, last);
+  _nodes[idx].left  = left;
+  _nodes[idx].right = right;
+  return idx;
+}
+
+/**
+ * Calculates an upper bound on the cosine between the normal of a surface and
+ * the direction to any light under a node. If every light is below the
+ * surface this is negative.
+ *
+ * @param nd the node to bound
+ * @param p the point on the surface
+ * @param n the normalized normal of the surface
+ * @return the largest possible cosine
+ */
+double light_tree::cosine(const node& nd, const point& p, const Vector<3>& n) const {
+  Vector<3> d = nd.center - p;
+  double dist = d.length();
+
+  if(dist <= nd.radius) {
+    return 1;
+  }
+
+  double sin_t = nd.radius / dist;
+  double cos_t = sqrt(1 - sin_t * sin_t);
+  double cos_a = d.dot(n) / dist;
+  double sin_a = sqrt(max(0.0, 1 - cos_a * cos_a));
+
+  if(cos_a >= cos_t) {
+    return 1;
+  }
+
+  return cos_a * cos_t + sin_a * sin_t;
+}
+
+/**
+ * Selects the lights that should be shaded at a point on a surface. Each
+ * selected light is returned with the weight its contribution should be
+ * scaled by. The lights are returned in the order they appear in the model.
+ *
+ * @param p the point on the surface
+ * @param n the normalized normal of the surface, facing the incoming ray
+ * @param kd the largest diffuse factor of the surface, scaled by the ray
+ * @param ks the specular factor of the surface, scaled by the ray
+ * @param seed the seed used to choose lights when sampling
+ * @param out the selected lights and their weights
+ */
+void light_tree::select(const point& p, const Vector<3>& n, double kd, double ks,
+    unsigned long seed, vector<pair<int, double> >& out) const {
+  out.clear();
+
+  for(auto iter = _directional.begin(); iter != _directional.end(); iter++) {
+    out.push_back(pair<int, double>(*iter, 1.0));
+  }
+
+  if(_n_point != 0) {
+    if(samples > 0 && samples < _n_point) {
+      sample(p, n, seed, out);
+    } else {
+      cull(0, p, n, kd, ks, out);
+    }
+  }
+
+  sort(out.begin(), out.end());
+}
+
+/**
+ * Selects every light under a node that can contribute at least threshold to
+ * the pixel.
+ *
+ * @param idx the index of the node
+ * @param p the point on the surface
+ * @param n the normalized normal of the surface
+ * @param kd the largest diffuse factor of the surface, scaled by the ray
+ * @param ks the specular factor of the surface, scaled by the ray
+ * @param out the selected lights
+ */
+void light_tree::cull(int idx, const point& p, const Vector<3>& n, double kd, double ks,
+    vector<pair<int, double> >& out) const {
+  const node& nd = _nodes[idx];
+  double c = cosine(nd, p, n);
+
+  if(c < 0 || (threshold > 0 && nd.max * (kd * c + ks) < threshold)) {
+    return;
+  }
+
+  if(nd.light >= 0) {
+    out.push_back(pair<int, double>(nd.light, 1.0));
+  } else {
+    cull(nd.left,  p, n, kd, ks, out);
+    cull(nd.right, p, n, kd, ks, out);
+  }
+}
+
+/**
+ * Chooses samples point lights. Each sample walks down the tree picking a
+ * child with a probability proportional to its power times the bound on its
+ * cosine, so the walk is logarithmic in the number of lights.
+ *
+ * @param p the point on the surface
+ * @param n the normalized normal of the surface
+ * @param seed the seed for the random choices
+ * @param out the chosen lights and their weights
+ */
+void light_tree::sample(const point& p, const Vector<3>& n, unsigned long seed,
+    vector<pair<int, double> >& out) const {
+  if(cosine(_nodes[0], p, n) < 0) {
+    return;
+  }
+
+  for(int s = 0; s < samples; s++) {
+    double u = uniform(seed * samples + s);
+    double pdf = 1;
+    int idx = 0;
+
+    while(_nodes[idx].light < 0) {
+      const node& l = _nodes[_nodes[idx].left];
+      const node& r = _nodes[_nodes[idx].right];
+      double wl = l.power * max(0.0, cosine(l, p, n));
+      double wr = r.power * max(0.0, cosine(r, p, n));
+
+      if(wl + wr == 0) {
+        break;
+      }
+
+      double pl = wl / (wl + wr);
+      if(u < pl) {
+        idx = _nodes[idx].left;
+        u /= pl;
+        pdf *= pl;
+      } else {
+        idx = _nodes[idx].right;
+        u = (u - pl) / (1 - pl);
+        pdf *= 1 - pl;
+      }
+    }
+
+    if(_nodes[idx].light >= 0) {
+      out.push_back(pair<int, double>(_nodes[idx].light, 1.0 / (samples * pdf)));
+    }
+  }
+}
+
+/**
+ * Finds the depth of every leaf of the tree, the root is at depth 0.
+ *
+ * @param out the depth of each leaf
+ */
+void light_tree::depths(vector<int>& out) const {
+  vector<pair<int, int> > stack;
+
+  out.clear();
+  if(_nodes.empty()) {
+    return;
+  }
+
+  stack.push_back(pair<int, int>(0, 0));
+  while(!stack.empty()) {
+    pair<int, int> top = stack.back();
+    const node& nd = _nodes[top.first];
+    stack.pop_back();
+
+    if(nd.light >= 0) {
+      out.push_back(top.second);
+    } else {
+      stack.push_back(pair<int, int>(nd.left,  top.second + 1));
+      stack.push_back(pair<int, int>(nd.right, top.second + 1));
+    }
+  }
+}
+
+/**
+ * @return the number of bytes used by the tree
+ */
+unsigned long light_tree::bytes() const {
+  return _nodes.capacity() * sizeof(node) + _directional.capacity() * sizeof(int) +
+      _power.capacity() * sizeof(double);
+}
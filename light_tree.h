@@ -0,0 +1,92 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef LIGHT_TREE_H_INCLUDE
+#define LIGHT_TREE_H_INCLUDE
+
+#include <Vector.tpp>
+
+#include <utility>
+using std::pair;
+#include <vector>
+using std::vector;
+
+class light;
+
+/**
+ * A bounding volume hierarchy over the point lights of a model. The lights in
+ * this ray tracer do not fall off with distance, so the only thing that bounds
+ * the contribution of a group of lights at a surface is the power of the
+ * lights and how far above the surface they can be. Each node keeps a bounding
+ * sphere and the power of its lights so that whole groups of lights can be
+ * rejected or sampled without looking at every light.
+ *
+ * The tree is used in one of two ways:
+ *   1. culling: every light that can reach the surface is selected, except
+ *      for lights whose largest possible contribution to the pixel is below
+ *      threshold. With a threshold of zero this selects exactly the lights
+ *      that the brute force loop would have shaded.
+ *
+ *   2. sampling: if samples is set, only that many point lights are chosen at
+ *      each surface, each with a probability proportional to an estimate of
+ *      its contribution. The weight of a chosen light is the inverse of its
+ *      probability so that the expected color is unchanged.
+ *
+ * Directional lights cannot be bound by a sphere and are always selected.
+ *
+ * @file light_tree.h
+ */
+class light_tree {
+  public:
+
+    light_tree() : _nodes(), _directional(), _power(), _n_point(0) { }
+    light_tree(const vector<light>& lights);
+    virtual ~light_tree() { }
+
+    void select(const point& p, const Vector<3>& n, double kd, double ks,
+        unsigned long seed, vector<pair<int, double> >& out) const;
+
+    inline int size() const { return _power.size(); }
+    void depths(vector<int>& out) const;
+    unsigned long bytes() const;
+
+    static double uniform(unsigned long long seed);
+
+    static double threshold;
+    static int    samples;
+
+  protected:
+
+    /** a node of the tree, leaves hold a single light */
+    struct node {
+      point  center;   ///< center of the sphere bounding the lights
+      double radius;   ///< radius of the sphere bounding the lights
+      double power;    ///< summed power of the lights under the node
+      double max;      ///< power of the brightest light under the node
+      int    left;     ///< index of the first child, -1 for a leaf
+      int    right;    ///< index of the second child, -1 for a leaf
+      int    light;    ///< the light held by a leaf
+    };
+
+    int build(vector<pair<point, int> >& lights, int first, int last);
+    double cosine(const node& nd, const point& p, const Vector<3>& n) const;
+    void cull(int idx, const point& p, const Vector<3>& n, double kd, double ks,
+        vector<pair<int, double> >& out) const;
+    void sample(const point& p, const Vector<3>& n, unsigned long seed,
+        vector<pair<int, double> >& out) const;
+
+    vector<node>   _nodes;       ///< the tree, the root is the first node
+    vector<int>    _directional; ///< lights that are not in the tree
+    vector<double> _power;       ///< the power of every light
+    int            _n_point;     ///< number of lights in the tree
+};
+
+#endif /* LIGHT_TREE_H_INCLUDE */
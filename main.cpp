@@ -10,13 +10,27 @@
  **************************************************************************** */
 
 /* local includes */
+#include <arena.h>
+#include <batch.h>
 #include <shape.h>
 #include <object.h>
 #include <model.h>
 #include <lexer.h>
 #include <camera.h>
+#include <checkpoint.h>
+#include <denoiser.h>
+#include <display.h>
+#include <fastmath.h>
+#include <heatmap.h>
+#include <pool.h>
+#include <raster.h>
+#include <shadow_cache.h>
+#include <trace.h>
 
 /* library includes */
+#include <algorithm>
+using std::max;
+#include <cstdlib>
 #include <exception>
 using std::exception;
 #include <fstream>
@@ -24,11 +38,75 @@ using std::ifstream;
 #include <iostream>
 using std::cout;
 using std::cerr;
+using std::endl;
 using std::flush;
+#include <sstream>
+#include <string>
+using std::string;
 #include <utility>
 using std::pair;
+#include <sys/resource.h>
 
-pair<model*, camera*> parse(const char* filename) {
+/**
+ * @return the largest resident set of the process so far in kilobytes
+ */
+long peak_rss() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/**
+ * Hashes the command line and a scene file, a checkpoint is only resumed by a
+ * render of the same scene with the same options. Options that change how
+ * the render runs but not what it draws, --resume among them, are left out.
+ *
+ * @param argc the number of arguments
+ * @param argv the arguments
+ * @param filename the scene file
+ * @return the fingerprint
+ */
+unsigned long long fingerprint(int argc, char** argv, const char* filename) {
+  unsigned long long hash = 14695981039346656037ull;
+  std::ostringstream text;
+
+  static const char* flags[] = { "--resume", "--stats" };
+  static const char* options[] = { "--checkpoint-every", "--threads", "--affinity", "--fps", "--trace" };
+  for(int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if(std::find(flags, flags + 2, arg) != flags + 2) {
+      continue;
+    } else if(std::find(options, options + 5, arg) != options + 5) {
+      i++;
+      continue;
+    }
+    text << arg << '\0';
+  }
+  text << ifstream(filename, std::ios::binary).rdbuf();
+
+  string all = text.str();
+  for(auto iter = all.begin(); iter != all.end(); iter++) {
+    hash = (hash ^ (unsigned char)*iter) * 1099511628211ull;
+  }
+
+  return hash;
+}
+
+/**
+ * Reads a scene file into a model and a camera. The shapes, objects and
+ * transforms that are read are only needed until the model is built, they are
+ * made in an arena that is released as soon as the model exists.
+ *
+ * A scene can have several cameras. The first is returned with the model, the
+ * rest are added to views, or ignored if views is NULL.
+ *
+ * @param filename the scene file
+ * @param views where the cameras after the first go, may be NULL
+ * @return the model and camera, both NULL if the file could not be read
+ */
+pair<model*, camera*> parse(const char* filename, vector<camera*>* views) {
+  long long start = trace::now();
+  arena scene;                        // owns everything read from the file
   lexer istr(filename);
   string curr;                        // the current type of object being loaded from the file
   map<string, shape*> shapes;         // the set of shape retrieved from the file
@@ -51,11 +129,11 @@ pair<model*, camera*> parse(const char* filename) {
     /* read the file into a model */
     for(istr >> curr; !istr.eof() && !istr.fail(); istr >> curr) {
       if(curr == "Shape") {
-        shape* s = new shape();
+        shape* s = scene.create<shape>();
         istr >> *s;
         shapes[s->name()] = s;
       } else if(curr == "Object") {
-        object* obj = new object();
+        object* obj = scene.create<object>(&scene);
         istr >> *obj;
         objects.push_back(obj);
         if(shapes.find(obj->shape()) == shapes.end()) {
@@ -72,6 +150,12 @@ pair<model*, camera*> parse(const char* filename) {
       } else if(curr == "Camera" && ret.second == NULL) {
         ret.second = new camera();
         istr >> *(ret.second);
+      } else if(curr == "Camera" && views != NULL) {
+        views->push_back(new camera());
+        istr >> *(views->back());
+      } else if(curr == "Camera") {
+        camera ignored;
+        istr >> ignored;
       } else if(curr == "LightSource"){
         light l;
         istr >> l;
@@ -89,33 +173,395 @@ pair<model*, camera*> parse(const char* filename) {
     cerr << "ERROR: invalid syntax in: " << filename << endl;
     cerr << "ERROR: error found on line: " << istr.line_number() << endl;
     cerr << "ERROR: line reads: " << istr.line_stream().str() << endl;
-    for(map<string, shape*>::iterator iter = shapes.begin();
-        iter != shapes.end(); iter++)
-      delete iter->second;
-    for(vector<object*>::iterator iter = objects.begin();
-        iter != objects.end(); iter++)
-      delete *iter;
     return ret;
   }
 
+  /* the model is read by every worker, spread it over their nodes */
+  long long parsed = trace::now();
+  pool::interleave(true);
+  try {
+    ret.first = new model(shapes, objects, lights, materials);
+  } catch(exception& e) {
+    pool::interleave(false);
+    cerr << "ERROR: could not build the model of: " << filename << endl;
+    delete ret.second;
+    ret.second = NULL;
+    return ret;
+  }
+  pool::interleave(false);
+  long long built = trace::now();
+  if(ret.second != NULL) {
+    ret.second->specialize(ret.first);
+  }
+  if(views != NULL) {
+    for(auto iter = views->begin(); iter != views->end(); iter++) {
+      (*iter)->specialize(ret.first);
+    }
+  }
+
+  size_t used = scene.used(), mapped = scene.mapped(), huge = scene.huge();
+  int blocks = scene.blocks();
+  scene.release();
+  long long released = trace::now();
+
+  if(model::stats) {
+    cout << "scene: parse " << (parsed - start) / 1e6 << " ms, build " << (built - parsed) / 1e6
+         << " ms, release " << (released - built) / 1e6 << " ms" << endl;
+    cout << "arena: " << used / 1024 << " KiB used of " << mapped / 1024 << " KiB in " << blocks
+         << " blocks, " << huge / 1024 << " KiB on explicit huge pages" << endl;
+    cout << "peak rss: " << peak_rss() << " KiB" << endl;
+  }
 
-  ret.first = new model(shapes, objects, lights, materials);
   return ret;
 }
 
+/**
+ * Reads a scene file, only its first camera is kept.
+ *
+ * @param filename the scene file
+ * @return the model and camera, both NULL if the file could not be read
+ */
+pair<model*, camera*> parse(const char* filename) {
+  return parse(filename, NULL);
+}
+
+/**
+ * Applies an edit file to a model. The file uses the syntax of a scene file:
+ * each Material replaces the material of the same name and, if there are any
+ * LightSources, they replace every light of the model.
+ *
+ * @param m the model to edit
+ * @param filename the edit file
+ * @return false if the file could not be read
+ */
+bool edit(model* m, const char* filename) {
+  lexer istr(filename);
+  string curr;
+  vector<light> lights;
+
+  if(istr.fail()) {
+    cerr << "ERROR: Could not open edit file: " << filename << endl;
+    return false;
+  }
+
+  try {
+    for(istr >> curr; !istr.eof() && !istr.fail(); istr >> curr) {
+      if(curr == "Material") {
+        material mat;
+        istr >> mat;
+        m->mat(mat.name()) = mat;
+      } else if(curr == "LightSource") {
+        light l;
+        istr >> l;
+        lights.push_back(l);
+      } else {
+        throw exception();
+      }
+    }
+  } catch(exception& e) {
+    cerr << "ERROR: invalid edit in: " << filename << endl;
+    cerr << "ERROR: error found on line: " << istr.line_number() << endl;
+    return false;
+  }
+
+  if(!lights.empty()) {
+    m->relight(lights);
+  }
+  return true;
+}
+
+/**
+ * Renders a scene once with each accuracy tier of fastmath and prints how far
+ * each image is from the exact one, as the largest and mean difference of any
+ * colour channel, and how long each render took. The renders are neither
+ * shown nor written, so only the tracing is timed.
+ *
+ * @param filename the scene to render
+ */
+void math_report(const char* filename) {
+  pair<model*, camera*> p = parse(filename);
+  fastmath::tier saved = fastmath::mode;
+  cv::Mat reference;
+
+  if(p.first == NULL || p.second == NULL) {
+    delete p.first;
+    delete p.second;
+    return;
+  }
+
+  for(int t = fastmath::exact; t <= fastmath::approx; t++) {
+    fastmath::mode = fastmath::tier(t);
+
+    long long start = trace::now();
+    p.second->render(p.first);
+    double ms = (trace::now() - start) / 1e6;
+
+    const cv::Mat& image = p.second->image();
+    if(t == fastmath::exact) {
+      reference = image;
+    }
+
+    int worst = 0;
+    double total = 0;
+    long n = long(image.rows) * image.cols * 3;
+    for(int y = 0; y < image.rows; y++) {
+      for(int x = 0; x < image.cols; x++) {
+        const Vector<3, uc>& a = image.at<Vector<3, uc> >(y, x);
+        const Vector<3, uc>& b = reference.at<Vector<3, uc> >(y, x);
+        for(int c = 0; c < 3; c++) {
+          int d = a[c] > b[c] ? a[c] - b[c] : b[c] - a[c];
+          worst = max(worst, d);
+          total += d;
+        }
+      }
+    }
+
+    cout << filename << " " << fastmath::name(fastmath::tier(t)) << ": max error " << worst
+         << ", mean error " << total / n << ", " << ms << " ms" << endl;
+  }
+
+  fastmath::mode = saved;
+  delete p.first;
+  delete p.second;
+}
+
 /* ************************************************************************** */
 /* *** main function of ray tracer ****************************************** */
 /* ************************************************************************** */
 
 int main(int argc, char** argv) {
+  string trace_file;
+  bool report = false;
+  bool analyze = false;
+  vector<string> edits;
+  bool pipeline = false;
+  vector<string> files;
+  string checkpoints;
+  int scenes = 0;
+
   for(int i = 1; i < argc; i++) {
-    pair<model*, camera*> p = parse(argv[i]);
-    if(p.second != NULL && p.first != NULL) {
-      p.second->click(p.first);
+    /* command line options */
+    if(string(argv[i]) == "--trace" && i + 1 < argc) {
+      trace::enabled = true;
+      trace_file = argv[++i];
+      continue;
+    } else if(string(argv[i]) == "--heatmap" && i + 1 < argc) {
+      if(!heatmap::parse(argv[++i])) {
+        cerr << "ERROR: unknown heatmap metric: " << argv[i] << endl;
+        cerr << "ERROR: expected tests, bounces, shadows or time" << endl;
+        return 1;
+      }
+      continue;
+    } else if(string(argv[i]) == "--stats") {
+      model::stats = true;
+      continue;
+    } else if(string(argv[i]) == "--light-cull" && i + 1 < argc) {
+      light_tree::threshold = strtod(argv[++i], NULL);
+      continue;
+    } else if(string(argv[i]) == "--light-samples" && i + 1 < argc) {
+      light_tree::samples = atoi(argv[++i]);
+      continue;
+    } else if(string(argv[i]) == "--math" && i + 1 < argc) {
+      if(!fastmath::parse(argv[++i])) {
+        cerr << "ERROR: unknown math tier: " << argv[i] << endl;
+        cerr << "ERROR: expected exact, fast or approx" << endl;
+        return 1;
+      }
+      continue;
+    } else if(string(argv[i]) == "--out-of-core" && i + 1 < argc) {
+      page_cache::file = argv[++i];
+      continue;
+    } else if(string(argv[i]) == "--page-cache" && i + 1 < argc) {
+      page_cache::capacity = strtoul(argv[++i], NULL, 10) << 20;
+      continue;
+    } else if(string(argv[i]) == "--page-chunk" && i + 1 < argc) {
+      page_cache::chunk_bytes = strtoul(argv[++i], NULL, 10) << 10;
+      continue;
+    } else if(string(argv[i]) == "--stream" && i + 1 < argc) {
+      image_writer::file = argv[++i];
+      continue;
+    } else if(string(argv[i]) == "--band-rows" && i + 1 < argc) {
+      image_writer::band_rows = atoi(argv[++i]);
+      continue;
+    } else if(string(argv[i]) == "--cull-tile" && i + 1 < argc) {
+      frustum::tile = atoi(argv[++i]);
+      continue;
+    } else if(string(argv[i]) == "--ray-budget" && i + 1 < argc) {
+      ray::budget = atoi(argv[++i]);
+      continue;
+    } else if(string(argv[i]) == "--roulette" && i + 1 < argc) {
+      ray::roulette = strtod(argv[++i], NULL);
+      continue;
+    } else if(string(argv[i]) == "--schedule" && i + 1 < argc) {
+      if(!ray::parse(argv[++i])) {
+        cerr << "ERROR: unknown schedule: " << argv[i] << endl;
+        cerr << "ERROR: expected band, fifo or contribution" << endl;
+        return 1;
+      }
+      continue;
+    } else if(string(argv[i]) == "--time-budget" && i + 1 < argc) {
+      ray::time_budget = strtod(argv[++i], NULL);
+      continue;
+    } else if(string(argv[i]) == "--shadow-cache" && i + 1 < argc) {
+      shadow_cache::cells = atoi(argv[++i]);
+      continue;
+    } else if(string(argv[i]) == "--shadow-check") {
+      shadow_cache::check = true;
+      continue;
+    } else if(string(argv[i]) == "--raster") {
+      raster::enabled = true;
+      continue;
+    } else if(string(argv[i]) == "--denoise" && i + 1 < argc) {
+      denoiser::passes = atoi(argv[++i]);
+      gbuffer::enabled = true;
+      continue;
+    } else if(string(argv[i]) == "--denoise-sigma" && i + 1 < argc) {
+      denoiser::sigma = strtod(argv[++i], NULL);
+      continue;
+    } else if(string(argv[i]) == "--checkpoint" && i + 1 < argc) {
+      checkpoints = argv[++i];
+      scenes = 0;
+      continue;
+    } else if(string(argv[i]) == "--checkpoint-every" && i + 1 < argc) {
+      checkpoint::every = strtod(argv[++i], NULL);
+      continue;
+    } else if(string(argv[i]) == "--resume") {
+      checkpoint::resume = true;
+      continue;
+    } else if(string(argv[i]) == "--fps" && i + 1 < argc) {
+      display::fps = atoi(argv[++i]);
+      continue;
+    } else if(string(argv[i]) == "--math-report") {
+      report = true;
+      continue;
+    } else if(string(argv[i]) == "--relight" && i + 1 < argc) {
+      gbuffer::enabled = true;
+      edits.push_back(argv[++i]);
+      continue;
+    } else if(string(argv[i]) == "--analyze") {
+      analyze = true;
+      continue;
+    } else if(string(argv[i]) == "--threads" && i + 1 < argc) {
+      pool::threads = atoi(argv[++i]);
+      continue;
+    } else if(string(argv[i]) == "--affinity" && i + 1 < argc) {
+      pool::affinity = argv[++i];
+      continue;
+    } else if(string(argv[i]) == "--batch") {
+      pipeline = true;
+      continue;
+    } else if(string(argv[i]) == "--batch-scenes" && i + 1 < argc) {
+      batch::scenes = atoi(argv[++i]);
+      continue;
+    }
+
+    if(report) {
+      math_report(argv[i]);
+      continue;
+    }
+
+    if(pipeline) {
+      files.push_back(argv[i]);
+      continue;
+    }
+
+    if(analyze) {
+      long long start = trace::now();
+      pair<model*, camera*> p = parse(argv[i]);
+      if(p.first != NULL) {
+        long long parsed = trace::now();
+        cout << "scene: " << argv[i] << endl;
+        p.first->analyze();
+        cout << "analyze: parse " << (parsed - start) / 1e6 << " ms, analysis "
+             << (trace::now() - parsed) / 1e6 << " ms" << endl;
+      }
+      delete p.first;
+      delete p.second;
+      continue;
+    }
+
+    /* each scene keeps its own checkpoint, the first in the file given and
+     * the rest in the file with the number of the scene added */
+    if(!checkpoints.empty()) {
+      std::ostringstream name;
+      name << checkpoints;
+      if(++scenes > 1) {
+        name << "." << scenes;
+      }
+      checkpoint::file = name.str();
+    }
+
+    vector<camera*> views;
+    checkpoint::key = fingerprint(argc, argv, argv[i]);
+    pair<model*, camera*> p = parse(argv[i], &views);
+    if(p.second != NULL && p.first != NULL && !views.empty()) {
+      views.insert(views.begin(), p.second);
+      long long start = trace::now();
+      camera::click(p.first, views);
+      if(model::stats) {
+        cout << "views: " << views.size() << " in " << (trace::now() - start) / 1e6 << " ms" << endl;
+      }
+      views.erase(views.begin());
+    } else if(p.second != NULL && p.first != NULL) {
+      if(image_writer::file.empty()) {
+        long long start = trace::now();
+        p.second->click(p.first);
+        if(model::stats && (!edits.empty() || raster::enabled)) {
+          cout << "render: " << (trace::now() - start) / 1e6 << " ms, g-buffer "
+               << p.second->primary()->bytes() / 1024 << " KiB" << endl;
+        }
+
+        for(unsigned int k = 0; k < edits.size(); k++) {
+          std::ostringstream name;
+          name << "relight_" << k + 1 << ".png";
+
+          start = trace::now();
+          if(edit(p.first, edits[k].c_str()) && p.second->reshade(p.first, name.str()) && model::stats) {
+            cout << "relight: " << edits[k] << " in " << (trace::now() - start) / 1e6 << " ms" << endl;
+          }
+        }
+      } else {
+        p.second->stream(p.first);
+      }
+      if(p.first->pages() != NULL) {
+        p.first->pages()->report();
+      }
+    }
+
+    if(p.first != NULL && p.first->shadows() != NULL && (model::stats || shadow_cache::check)) {
+      p.first->shadows()->report();
     }
+
+    long long start = trace::now();
     delete p.first;
     delete p.second;
+    for(auto iter = views.begin(); iter != views.end(); iter++) {
+      delete *iter;
+    }
+    if(model::stats) {
+      cout << "teardown: " << (trace::now() - start) / 1e6 << " ms" << endl;
+    }
   }
+
+  if(pipeline) {
+    if(!page_cache::file.empty() || !image_writer::file.empty()) {
+      cerr << "ERROR: --batch cannot be used with --out-of-core or --stream" << endl;
+      return 1;
+    }
+    batch(parse, files).run();
+  }
+
+  if(model::stats) {
+    ray::report();
+#ifndef DEBUG
+    pool::workers().report();
+#endif
+  }
+
+  if(trace::enabled) {
+    trace::write(trace_file);
+  }
+
   return 0;
 }
 
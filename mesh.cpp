@@ -0,0 +1,185 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <mesh.h>
+#include <heatmap.h>
+
+#include <algorithm>
+using std::max;
+
+/**
+ * Adds an object to the side table of object names.
+ *
+ * @param name the name used to describe the object
+ * @return the index of the object
+ */
+uint32_t mesh::add_object(const string& name) {
+  _objects.push_back(name);
+  return _objects.size() - 1;
+}
+
+/**
+ * Adds a convex polygon to the mesh. The polygon is split into a fan of
+ * triangles around its first vertex, the same fan that the intersection test
+ * walks.
+ *
+ * @param vertices the vertices of the polygon, in order
+ * @param normal the normal of the polygon
+ * @param material the index of the material of the polygon
+ * @param object the object the polygon belongs to
+ * @return the index of the new face
+ */
+uint32_t mesh::add_face(const vector<point>& vertices, const Vector<3>& normal, int material, uint32_t object) {
+  vector<uint32_t> idx;
+
+  for(auto iter = vertices.begin(); iter != vertices.end(); iter++) {
+    tuple<double, double, double> key((*iter)[0], (*iter)[1], (*iter)[2]);
+    auto found = _lookup.find(key);
+
+    if(found == _lookup.end()) {
+      found = _lookup.insert(std::make_pair(key, uint32_t(_vertices.size()))).first;
+      _vertices.push_back(*iter);
+    }
+
+    idx.push_back(found->second);
+  }
+
+  for(unsigned int i = 1; i + 1 < idx.size(); i++) {
+    triangle t = { { idx[0], idx[i], idx[i + 1] } };
+    _triangles.push_back(t);
+  }
+
+  _first.push_back(_triangles.size());
+  _normals.push_back(normal);
+  _material.push_back(material);
+  _owner.push_back(object);
+  return _normals.size() - 1;
+}
+
+/**
+ * Called once every face has been added. Releases the memory that was only
+ * needed while building.
+ */
+void mesh::finish() {
+  map<tuple<double, double, double>, uint32_t>().swap(_lookup);
+  _vertices.shrink_to_fit();
+  _triangles.shrink_to_fit();
+  _first.shrink_to_fit();
+  _normals.shrink_to_fit();
+  _material.shrink_to_fit();
+  _owner.shrink_to_fit();
+}
+
+/**
+ * @return the number of bytes used by the vertices, triangles and side tables
+ */
+unsigned long mesh::bytes() const {
+  unsigned long ret = 0;
+
+  ret += _vertices.capacity()  * sizeof(point);
+  ret += _triangles.capacity() * sizeof(triangle);
+  ret += _first.capacity()     * sizeof(uint32_t);
+  ret += _normals.capacity()   * sizeof(Vector<3>);
+  ret += _material.capacity()  * sizeof(int);
+  ret += _owner.capacity()     * sizeof(uint32_t);
+  for(auto iter = _objects.begin(); iter != _objects.end(); iter++) {
+    ret += sizeof(string) + iter->capacity();
+  }
+
+  return ret;
+}
+
+/**
+ * Finds the closest of a list of faces that a ray hits. A face is hit where
+ * the first triangle of its fan is hit.
+ *
+ * @param faces the faces to test
+ * @param n the number of faces
+ * @param U the direction of the ray
+ * @param L the origin of the ray
+ * @param skip the face the ray is leaving, -1 if it is not leaving a face
+ * @param t the distance to beat, set to the distance to the new hit
+ * @return the face that was hit, -1 if none was closer than t
+ */
+int mesh::nearest(const uint32_t* faces, int n, const Vector<3>& U, const point& L, int skip, double& t) const {
+  int best = -1;
+  double d;
+
+  for(int i = 0; i < n; i++) {
+    uint32_t f = faces[i];
+
+    if(int(f) == skip) {
+      continue;
+    }
+
+    heatmap::intersections++;
+    for(uint32_t j = _first[f]; j < _first[f + 1]; j++) {
+      const triangle& tri = _triangles[j];
+
+      if(intersect(_vertices[tri.v[0]], _vertices[tri.v[1]], _vertices[tri.v[2]], U, L, d)) {
+        if(d > 0 && d < t) {
+          t = d;
+          best = f;
+        }
+        break;
+      }
+    }
+  }
+
+  return best;
+}
+
+/**
+ * @param face the face
+ * @return the average of the vertices of the face
+ */
+point mesh::center(uint32_t face) const {
+  uint32_t first = _first[face], last = _first[face + 1];
+  point center(0);
+
+  center += _vertices[_triangles[first].v[0]];
+  for(uint32_t i = first; i < last; i++) {
+    center += _vertices[_triangles[i].v[1]];
+  }
+  center += _vertices[_triangles[last - 1].v[2]];
+
+  center /= (last - first + 2);
+  return center;
+}
+
+/**
+ * @param face the face
+ * @return the largest distance between the center and a vertex of the face
+ */
+double mesh::radius(uint32_t face) const {
+  uint32_t first = _first[face], last = _first[face + 1];
+  point c = center(face);
+  double rad = 0;
+
+  rad = max(c.distance(_vertices[_triangles[first].v[0]]), rad);
+  for(uint32_t i = first; i < last; i++) {
+    rad = max(c.distance(_vertices[_triangles[i].v[1]]), rad);
+  }
+  rad = max(c.distance(_vertices[_triangles[last - 1].v[2]]), rad);
+
+  return rad;
+}
+
+/**
+ * Drops the vertices and triangles once they have been written somewhere
+ * else, only the side tables are kept. Nothing that reads the vertices can be
+ * used afterwards.
+ */
+void mesh::page_out() {
+  vector<point>().swap(_vertices);
+  vector<triangle>().swap(_triangles);
+  vector<uint32_t>().swap(_first);
+}
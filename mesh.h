@@ -0,0 +1,121 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef MESH_H_INCLUDE
+#define MESH_H_INCLUDE
+
+#include <matrix.tpp>
+#include <Vector.tpp>
+
+#include <cstdint>
+#include <map>
+using std::map;
+#include <string>
+using std::string;
+#include <tuple>
+using std::tuple;
+#include <vector>
+using std::vector;
+
+/**
+ * Three indices into the vertex array of a mesh.
+ */
+struct triangle {
+  uint32_t v[3];
+};
+
+/**
+ * Storage for every polygon in a model. Vertices are stored once in a shared
+ * array and polygons are split into fans of triangles that index into it, so
+ * a vertex shared by several polygons costs 4 bytes per use instead of 24.
+ *
+ * Each polygon becomes a face, a contiguous range of triangles. The data that
+ * is only needed once a ray has hit a face (the normal and material) or not at
+ * all while rendering (the object the face came from) lives in side tables
+ * indexed by face, away from the vertices and triangles that are read by
+ * every test.
+ *
+ * @file mesh.h
+ */
+class mesh {
+  public:
+
+    mesh() : _vertices(), _triangles(), _first(1, 0), _normals(), _material(), _owner(), _objects(), _lookup() { }
+    virtual ~mesh() { }
+
+    uint32_t add_object(const string& name);
+    uint32_t add_face(const vector<point>& vertices, const Vector<3>& normal, int material, uint32_t object);
+    void finish();
+
+    int nearest(const uint32_t* faces, int n, const Vector<3>& U, const point& L, int skip, double& t) const;
+    point center(uint32_t face) const;
+    double radius(uint32_t face) const;
+
+    inline const point& vertex(uint32_t i) const { return _vertices[i]; }
+    inline const triangle& tri(uint32_t i) const { return _triangles[i]; }
+    inline uint32_t first(uint32_t face) const { return _first[face]; }
+    inline uint32_t last(uint32_t face) const { return _first[face + 1]; }
+    inline const Vector<3>& normal(uint32_t face) const { return _normals[face]; }
+    inline int material(uint32_t face) const { return _material[face]; }
+    inline uint32_t owner(uint32_t face) const { return _owner[face]; }
+    inline const string& object(uint32_t i) const { return _objects[i]; }
+
+    inline uint32_t vertices() const { return _vertices.size(); }
+    inline uint32_t triangles() const { return _triangles.size(); }
+    inline uint32_t faces() const { return _normals.size(); }
+    inline uint32_t objects() const { return _objects.size(); }
+
+    unsigned long bytes() const;
+    void page_out();
+
+    static inline bool intersect(const point& A, const point& B, const point& C,
+        const Vector<3>& U, const point& L, double& t);
+
+  protected:
+
+    vector<point>      _vertices;  ///< every distinct vertex in the model
+    vector<triangle>   _triangles; ///< the triangles of every face
+    vector<uint32_t>   _first;     ///< first triangle of each face, plus one past the end
+    vector<Vector<3> > _normals;   ///< the normal of each face
+    vector<int>        _material;  ///< the material of each face
+    vector<uint32_t>   _owner;     ///< the object each face belongs to
+    vector<string>     _objects;   ///< the name of the shape of each object
+
+    /** used to find shared vertices while the mesh is being built */
+    map<tuple<double, double, double>, uint32_t> _lookup;
+};
+
+/**
+ * Intersects a ray with one triangle by solving for the barycentric
+ * coordinates of the hit and the distance along the ray.
+ *
+ * @param A the first vertex of the triangle
+ * @param B the second vertex of the triangle
+ * @param C the third vertex of the triangle
+ * @param U the direction of the ray
+ * @param L the origin of the ray
+ * @param t set to the distance to the hit
+ * @return true if the ray hits the triangle
+ */
+inline bool mesh::intersect(const point& A, const point& B, const point& C,
+    const Vector<3>& U, const point& L, double& t) {
+  Matrix<3, 4> m;
+
+  m[0][0] = A[0] - B[0]; m[0][1] = A[0] - C[0]; m[0][2] = U[0]; m[0][3] = A[0] - L[0];
+  m[1][0] = A[1] - B[1]; m[1][1] = A[1] - C[1]; m[1][2] = U[1]; m[1][3] = A[1] - L[1];
+  m[2][0] = A[2] - B[2]; m[2][1] = A[2] - C[2]; m[2][2] = U[2]; m[2][3] = A[2] - L[2];
+  m.gaussian_elimination();
+
+  t = m[2][3];
+  return m[0][3] >= 0 && m[1][3] >= 0 && m[2][3] >= 0 && m[0][3] + m[1][3] < 1;
+}
+
+#endif /* MESH_H_INCLUDE */
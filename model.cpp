@@ -10,19 +10,47 @@
  **************************************************************************** */
 
 #include <model.h>
+#include <frustum.h>
+#include <shadow_cache.h>
 
 #include <algorithm>
-using std::remove_if;
+using std::max;
+using std::min;
+using std::sort;
+#include <cmath>
 #include <exception>
 using std::exception;
 #include <iostream>
 using std::cerr;
+using std::cout;
+using std::endl;
+using std::ostream;
+#include <limits>
+using std::numeric_limits;
+#include <utility>
+using std::pair;
+
+/* intialize statics */
+bool model::stats = false;
 
 model::model(map<string, shape*> Shapes, vector<object*> objs, vector<light> lights, map<string, material> mats)
-    : _surfaces(), _lights(lights), _materials(mats) {
+    : _spheres(), _sphere_material(), _bounds(), _bound_first(), _bound_faces(), _lights(lights), _ltree(lights),
+      _materials(), _material_index(), _mesh(), _pages(NULL), _shadows(NULL) {
+  map<tuple<double, double, double, double>, int> groups;
+  vector<vector<uint32_t> > members;
+  unsigned long legacy = 0;
+
+  for(auto iter = mats.begin(); iter != mats.end(); iter++) {
+    _material_index[iter->first] = _materials.size();
+    _materials.push_back(iter->second);
+  }
+
   for(auto iter = objs.begin(); iter != objs.end(); iter++) {
     shape* base = Shapes[(*iter)->shape()];
     Matrix<4, 4> transform = identity<4>();
+    uint32_t owner = _mesh.add_object((*iter)->shape());
+    int mat = _material_index[(*iter)->material()];
+    vector<point> vertices;
     Vector<3> tmp;
 
     for(auto tran = (*iter)->rbegin(); tran != (*iter)->rend(); tran++) {
@@ -30,69 +58,683 @@ model::model(map<string, shape*> Shapes, vector<object*> objs, vector<light> lig
     }
 
     for(auto poly = base->pbegin(); poly != base->pend(); poly++) {
-      polygon* newPoly = new polygon();
-
+      vertices.clear();
       for(auto v = poly->begin(); v != poly->end(); v++) {
         tmp = transform * (*v);
-        newPoly->add_vertex(tmp);
+        vertices.push_back(tmp);
       }
 
-      newPoly->normal() = transform * poly->normal();
-      newPoly->material() = (*iter)->material();
+      tmp = transform * poly->normal();
+      uint32_t face = _mesh.add_face(vertices, tmp, mat, owner);
 
-      auto found = _surfaces.end();
-      sphere s(newPoly->center(), newPoly->radius());
-      for(auto get = _surfaces.begin(); get != _surfaces.end(); get++) {
-        if(**get == s) {
-          found = get;
-          break;
-        }
-      }
+      /* what the same polygon cost when it owned its vertices: 96 bytes of
+       * vtable, material name, id, flag, vertex vector and normal, plus the
+       * heap block for the vertices and the characters of the name */
+      legacy += 96 + 16 + vertices.size() * sizeof(point) + (*iter)->material().capacity();
+
+      /* polygons with the same bounding sphere share it */
+      point c = _mesh.center(face);
+      double r = _mesh.radius(face);
+      tuple<double, double, double, double> key(c[0], c[1], c[2], r);
+      auto found = groups.find(key);
 
-      if(found == _surfaces.end()) {
-        sphere* newSphere = new sphere();
-        newSphere->center() = newPoly->center();
-        newSphere->radius() = newPoly->radius();
-        newSphere->push_back(newPoly);
-        _surfaces.push_back(newSphere);
-      } else {
-        (*found)->push_back(newPoly);
+      if(found == groups.end()) {
+        found = groups.insert(std::make_pair(key, int(members.size()))).first;
+        members.push_back(vector<uint32_t>());
+        _bounds.push_back(c, r);
       }
+      members[found->second].push_back(face);
     }
     for(auto siter = ((shape*)base)->sbegin(); siter != ((shape*)base)->send(); siter++) {
-      sphere* newSphere = new sphere();
+      point c;
 
-      newSphere->center()   = transform * siter->center();
-      newSphere->radius()   = siter->radius() * (*iter)->scale();
-      newSphere->material() = (*iter)->material();
-      _surfaces.push_back(newSphere);
+      c = transform * siter->center();
+      _spheres.push_back(c, siter->radius() * (*iter)->scale());
+      _sphere_material.push_back(mat);
     }
+  }
 
-    delete *iter;
+  _mesh.finish();
+
+  /* flatten the groups so the faces of each are contiguous */
+  _bound_first.push_back(0);
+  for(auto iter = members.begin(); iter != members.end(); iter++) {
+    _bound_faces.insert(_bound_faces.end(), iter->begin(), iter->end());
+    _bound_first.push_back(_bound_faces.size());
   }
 
-  /* clean up memory passed to Model::Model() */
-  for(auto iter = Shapes.begin(); iter != Shapes.end(); iter++) {
-    delete iter->second;
+  if(stats && _mesh.triangles() != 0) {
+    unsigned long bytes = _mesh.bytes() + _bound_faces.size() * sizeof(uint32_t);
+    cout << "mesh: " << _mesh.faces() << " polygons, " << _mesh.triangles() << " triangles, "
+         << _mesh.vertices() << " vertices, " << double(bytes) / _mesh.triangles()
+         << " bytes/triangle (" << double(legacy) / _mesh.triangles()
+         << " with per-polygon vertices)" << endl;
+  }
+
+  /* move the polygons out to the page file, only the bounds stay behind */
+  if(!page_cache::file.empty() && !members.empty()) {
+    vector<point> centers;
+    for(int i = 0; i < _bounds.size(); i++) {
+      centers.push_back(_bounds.center(i));
+    }
+
+    _pages = new page_cache(_mesh, _bound_first, _bound_faces, centers);
+    _mesh.page_out();
+    vector<uint32_t>().swap(_bound_faces);
+  }
+
+  /* the cache needs every polygon, so it is not used out of core */
+  if(shadow_cache::cells > 0 && _pages == NULL) {
+    _shadows = new shadow_cache(this);
   }
 }
 
 model::~model() {
-  for(auto iter = _surfaces.begin(); iter != _surfaces.end(); iter++) {
-    delete *iter;
+  delete _shadows;
+  delete _pages;
+}
+
+/**
+ * Finds the closest surface that a ray hits. Spheres are tested in batches by
+ * the sphere lists, polygons are only tested if the ray passes through the
+ * sphere that bounds them.
+ *
+ * @param U the normalized direction of the ray
+ * @param L the origin of the ray
+ * @param skip the surface the ray is leaving
+ * @return the surface that was hit and the distance to it
+ */
+template<bool SPHERES, bool POLYGONS>
+hit model::intersection(const Vector<3>& U, const point& L, const hit& skip) const {
+  static thread_local vector<int> groups;
+  hit ret = hit::miss(numeric_limits<double>::infinity());
+  int sk = skip.type == hit::sphere ? int(skip.index) : -1;
+  int pk = skip.type == hit::polygon ? int(skip.index) : -1;
+  int idx;
+
+  if(SPHERES) {
+    if((idx = _spheres.nearest(U, L, sk, ret.t)) >= 0) {
+      ret.type  = hit::sphere;
+      ret.index = idx;
+    }
+
+    if(sk >= 0) {
+      double t = _spheres.leaving(sk, U, L);
+      if(t > 0 && t < ret.t) {
+        ret.t     = t;
+        ret.type  = hit::sphere;
+        ret.index = sk;
+      }
+    }
+  }
+
+  if(!POLYGONS) {
+    return ret;
+  }
+
+  _bounds.candidates(U, L, groups);
+  if((idx = nearest_face(groups, U, L, pk, ret.t)) >= 0) {
+    ret.type  = hit::polygon;
+    ret.index = idx;
+  }
+
+  return ret;
+}
+
+/**
+ * Finds the closest surface that a primary ray hits, testing only the part of
+ * the model that can be seen through its tile of the image.
+ *
+ * @param U the normalized direction of the ray
+ * @param L the origin of the ray
+ * @param part the spheres and groups of polygons the ray may hit, see frustum
+ * @return the surface that was hit and the distance to it
+ */
+template<bool SPHERES, bool POLYGONS>
+hit model::intersection(const Vector<3>& U, const point& L, const cull_list& part) const {
+  static thread_local vector<int> groups;
+  hit ret = hit::miss(numeric_limits<double>::infinity());
+  int idx;
+
+  if(SPHERES) {
+    if((idx = part.spheres.nearest(U, L, -1, ret.t)) >= 0) {
+      ret.type  = hit::sphere;
+      ret.index = part.sphere_index[idx];
+    }
+  }
+
+  if(!POLYGONS) {
+    return ret;
+  }
+
+  part.bounds.candidates(U, L, groups);
+  for(auto iter = groups.begin(); iter != groups.end(); iter++) {
+    *iter = part.bound_index[*iter];
+  }
+  if((idx = nearest_face(groups, U, L, -1, ret.t)) >= 0) {
+    ret.type  = hit::polygon;
+    ret.index = idx;
+  }
+
+  return ret;
+}
+
+/**
+ * Finds the closest polygon of some groups that a ray hits.
+ *
+ * @param groups the groups the ray passes through the bounds of, in order
+ * @param U the normalized direction of the ray
+ * @param L the origin of the ray
+ * @param skip the polygon the ray is leaving, -1 if none
+ * @param t the distance to beat, set to the distance of the hit
+ * @return the polygon that was hit, -1 if none is closer than t
+ */
+int model::nearest_face(const vector<int>& groups, const Vector<3>& U, const point& L, int skip, double& t) const {
+  int best = -1, idx;
+
+  if(_pages != NULL) {
+    return paged(groups, U, L, skip, t, false);
+  }
+
+  for(auto iter = groups.begin(); iter != groups.end(); iter++) {
+    uint32_t first = _bound_first[*iter];
+    int n = _bound_first[*iter + 1] - first;
+
+    if((idx = _mesh.nearest(&_bound_faces[first], n, U, L, skip, t)) >= 0) {
+      best = idx;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Checks if anything blocks a ray before it has traveled a distance.
+ *
+ * @param U the normalized direction of the ray
+ * @param L the origin of the ray
+ * @param skip the surface the ray is leaving
+ * @param dist how far the ray travels
+ * @return true if a surface is hit closer than dist
+ */
+template<bool SPHERES, bool POLYGONS>
+bool model::occluded(const Vector<3>& U, const point& L, const hit& skip, double dist) const {
+  static thread_local vector<int> groups;
+  int sk = skip.type == hit::sphere ? int(skip.index) : -1;
+  int pk = skip.type == hit::polygon ? int(skip.index) : -1;
+  double t = dist;
+
+  if(SPHERES) {
+    if(_spheres.nearest(U, L, sk, t) >= 0) {
+      return true;
+    }
+
+    if(sk >= 0) {
+      t = _spheres.leaving(sk, U, L);
+      if(t > 0 && t < dist) {
+        return true;
+      }
+    }
+  }
+
+  if(!POLYGONS) {
+    return false;
+  }
+
+  _bounds.candidates(U, L, groups);
+  if(_pages != NULL) {
+    t = dist;
+    return paged(groups, U, L, pk, t, true) >= 0;
+  }
+
+  for(auto iter = groups.begin(); iter != groups.end(); iter++) {
+    uint32_t first = _bound_first[*iter];
+    int n = _bound_first[*iter + 1] - first;
+
+    t = dist;
+    if(_mesh.nearest(&_bound_faces[first], n, U, L, pk, t) >= 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* the scene specific kernels of the camera use every combination */
+template hit model::intersection<false, false>(const Vector<3>&, const point&, const hit&) const;
+template hit model::intersection<false, true >(const Vector<3>&, const point&, const hit&) const;
+template hit model::intersection<true,  false>(const Vector<3>&, const point&, const hit&) const;
+template hit model::intersection<true,  true >(const Vector<3>&, const point&, const hit&) const;
+template hit model::intersection<false, false>(const Vector<3>&, const point&, const cull_list&) const;
+template hit model::intersection<false, true >(const Vector<3>&, const point&, const cull_list&) const;
+template hit model::intersection<true,  false>(const Vector<3>&, const point&, const cull_list&) const;
+template hit model::intersection<true,  true >(const Vector<3>&, const point&, const cull_list&) const;
+template bool model::occluded<false, false>(const Vector<3>&, const point&, const hit&, double) const;
+template bool model::occluded<false, true >(const Vector<3>&, const point&, const hit&, double) const;
+template bool model::occluded<true,  false>(const Vector<3>&, const point&, const hit&, double) const;
+template bool model::occluded<true,  true >(const Vector<3>&, const point&, const hit&, double) const;
+
+/**
+ * @return true if any surface of the model has a specular reflection
+ */
+bool model::specular() const {
+  for(auto iter = _sphere_material.begin(); iter != _sphere_material.end(); iter++) {
+    if(_materials[*iter].ks() != 0) {
+      return true;
+    }
+  }
+
+  for(uint32_t f = 0; f < _mesh.faces(); f++) {
+    if(_materials[_mesh.material(f)].ks() != 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @return true if any surface of the model lets light through
+ */
+bool model::translucent() const {
+  for(auto iter = _sphere_material.begin(); iter != _sphere_material.end(); iter++) {
+    if(_materials[*iter].kt() != 0) {
+      return true;
+    }
+  }
+
+  for(uint32_t f = 0; f < _mesh.faces(); f++) {
+    if(_materials[_mesh.material(f)].kt() != 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#define MAX_CELLS 64
+
+/**
+ * @return the key of a cell of the overlap grid
+ */
+static inline uint64_t cell_key(int x, int y, int z) {
+  return (uint64_t(uint32_t(x) & 0x1fffff) << 42) | (uint64_t(uint32_t(y) & 0x1fffff) << 21) |
+      uint64_t(uint32_t(z) & 0x1fffff);
+}
+
+/**
+ * Prints a histogram with one bucket per power of two, "1:5 2-3:7 4-7:1".
+ *
+ * @param ostr the stream to print to
+ * @param values the values to count
+ */
+static void histogram(ostream& ostr, const vector<int>& values) {
+  vector<unsigned long> buckets;
+
+  for(auto iter = values.begin(); iter != values.end(); iter++) {
+    unsigned int b = *iter <= 0 ? 0 : 32 - __builtin_clz(*iter);
+    if(b >= buckets.size()) {
+      buckets.resize(b + 1, 0);
+    }
+    buckets[b]++;
+  }
+
+  for(unsigned int b = 0; b < buckets.size(); b++) {
+    if(buckets[b] == 0) {
+      continue;
+    }
+
+    int lo = b == 0 ? 0 : 1 << (b - 1), hi = b == 0 ? 0 : (1 << b) - 1;
+    ostr << " " << lo;
+    if(hi != lo) {
+      ostr << "-" << hi;
+    }
+    ostr << ":" << buckets[b];
+  }
+}
+
+/**
+ * Counts how many other spheres of a list each sphere overlaps. The spheres
+ * are put in a uniform grid with cells about the size of the average sphere
+ * and only spheres that share a cell are compared. A pair is counted in the
+ * first cell the two share. Spheres that would cover too many cells are kept
+ * aside and compared with every sphere.
+ *
+ * @param s the spheres
+ * @return the number of overlaps of each sphere
+ */
+static vector<int> overlaps(const sphere_list& s) {
+  int n = s.size();
+  vector<int> count(n, 0), large;
+  vector<point> c(n);
+  vector<double> r(n);
+  vector<Vector<3, int> > lo(n), hi(n);
+  vector<pair<uint64_t, int> > grid;
+  double size = 0;
+
+  for(int i = 0; i < n; i++) {
+    c[i] = s.center(i);
+    r[i] = s.radius(i);
+    size += 2 * r[i] / n;
+  }
+  if(size <= 0) {
+    size = 1;
+  }
+
+  for(int i = 0; i < n; i++) {
+    long cells = 1;
+    for(int j = 0; j < 3; j++) {
+      lo[i][j] = int(floor((c[i][j] - r[i]) / size));
+      hi[i][j] = int(floor((c[i][j] + r[i]) / size));
+      cells *= hi[i][j] - lo[i][j] + 1;
+    }
+
+    if(cells > MAX_CELLS) {
+      large.push_back(i);
+      continue;
+    }
+
+    for(int x = lo[i][0]; x <= hi[i][0]; x++) {
+      for(int y = lo[i][1]; y <= hi[i][1]; y++) {
+        for(int z = lo[i][2]; z <= hi[i][2]; z++) {
+          grid.push_back(pair<uint64_t, int>(cell_key(x, y, z), i));
+        }
+      }
+    }
+  }
+  sort(grid.begin(), grid.end());
+
+  for(unsigned int first = 0, last; first < grid.size(); first = last) {
+    for(last = first + 1; last < grid.size() && grid[last].first == grid[first].first; last++);
+
+    for(unsigned int a = first; a < last; a++) {
+      for(unsigned int b = a + 1; b < last; b++) {
+        int i = grid[a].second, j = grid[b].second;
+        double d = r[i] + r[j];
+        if((c[i] - c[j]).dot(c[i] - c[j]) < d * d && grid[a].first ==
+            cell_key(max(lo[i][0], lo[j][0]), max(lo[i][1], lo[j][1]), max(lo[i][2], lo[j][2]))) {
+          count[i]++;
+          count[j]++;
+        }
+      }
+    }
+  }
+
+  vector<bool> is_large(n, false);
+  for(auto iter = large.begin(); iter != large.end(); iter++) {
+    is_large[*iter] = true;
+  }
+  for(auto iter = large.begin(); iter != large.end(); iter++) {
+    int i = *iter;
+    for(int j = 0; j < n; j++) {
+      double d = r[i] + r[j];
+      if(j == i || (is_large[j] && j < i)) {
+        continue;
+      }
+      if((c[i] - c[j]).dot(c[i] - c[j]) < d * d) {
+        count[i]++;
+        count[j]++;
+      }
+    }
   }
+
+  return count;
+}
+
+/**
+ * Prints how the model is built and what a ray costs, without rendering it.
+ * The cost of a ray is estimated by assuming rays cross the sphere that
+ * bounds the scene uniformly, a ray then passes through a sphere of radius r
+ * inside a scene of radius R with a chance of about (r / R)^2.
+ */
+void model::analyze() const {
+  int n_groups = _bounds.size();
+  bool paged = _pages != NULL;
+
+  /* primitives */
+  int directional = 0;
+  for(auto iter = _lights.begin(); iter != _lights.end(); iter++) {
+    directional += iter->directional();
+  }
+  cout << "primitives: " << _mesh.objects() << " objects, " << _spheres.size() << " spheres, "
+       << _mesh.faces() << " polygons in " << n_groups << " groups, " << _mesh.triangles()
+       << " triangles, " << _mesh.vertices() << " vertices, " << _lights.size() - directional
+       << " point and " << directional << " directional lights, " << _materials.size()
+       << " materials" << endl;
+
+  /* the sphere that bounds the scene */
+  point lo, hi;
+  bool any = false;
+  for(int l = 0; l < 2; l++) {
+    const sphere_list& s = l == 0 ? _spheres : _bounds;
+    for(int i = 0; i < s.size(); i++) {
+      for(int j = 0; j < 3; j++) {
+        double a = s.center(i)[j] - s.radius(i), b = s.center(i)[j] + s.radius(i);
+        lo[j] = any ? min(lo[j], a) : a;
+        hi[j] = any ? max(hi[j], b) : b;
+      }
+      any = true;
+    }
+  }
+  double R = any ? 0.5 * lo.distance(hi) : 0;
+
+  /* how often a ray passes through each group */
+  vector<double> chance(n_groups);
+  vector<int> group_faces(n_groups), group_tris(n_groups);
+  double groups_hit = 0, face_tests = 0, tri_tests = 0;
+  for(int g = 0; g < n_groups; g++) {
+    double r = _bounds.radius(g);
+    chance[g] = R > 0 ? min(1.0, (r * r) / (R * R)) : 1.0;
+    group_faces[g] = _bound_first[g + 1] - _bound_first[g];
+    group_tris[g] = 0;
+    if(!paged) {
+      for(uint32_t f = _bound_first[g]; f < _bound_first[g + 1]; f++) {
+        group_tris[g] += _mesh.last(_bound_faces[f]) - _mesh.first(_bound_faces[f]);
+      }
+    }
+
+    groups_hit += chance[g];
+    face_tests += chance[g] * group_faces[g];
+    tri_tests  += chance[g] * group_tris[g];
+  }
+
+  /* overlap of the bounding spheres */
+  vector<int> bound_overlaps = overlaps(_bounds), sphere_overlaps = overlaps(_spheres);
+  for(int l = 0; l < 2; l++) {
+    const vector<int>& count = l == 0 ? bound_overlaps : sphere_overlaps;
+    unsigned long pairs = 0;
+    int touching = 0, most = 0;
+    for(auto iter = count.begin(); iter != count.end(); iter++) {
+      pairs += *iter;
+      touching += *iter != 0;
+      most = max(most, *iter);
+    }
+
+    cout << "overlap: " << (l == 0 ? "group bounds" : "spheres") << ", " << pairs / 2
+         << " overlapping pairs, " << touching << " of " << count.size() << " overlap another, "
+         << (count.empty() ? 0.0 : double(pairs) / count.size()) << " mean, " << most << " most" << endl;
+  }
+
+  cout << "cost: scene radius " << R << ", per ray " << _spheres.size() << " sphere tests, "
+       << n_groups << " bound tests, " << groups_hit << " groups entered, " << face_tests
+       << " polygon tests";
+  if(!paged) {
+    cout << " (" << tri_tests << " triangles at most)";
+  }
+  cout << ", " << _spheres.size() + n_groups + face_tests << " tests in all" << endl;
+
+  /* the hierarchies: bounds over groups over polygons, and the light tree */
+  vector<int> depths;
+  cout << "hierarchy: groups are one level under a flat list of bounds" << endl;
+  if(n_groups != 0) {
+    cout << "leaves: polygons per group";
+    histogram(cout, group_faces);
+    cout << endl;
+  }
+  if(!paged && _mesh.faces() != 0) {
+    vector<int> fan;
+    for(uint32_t f = 0; f < _mesh.faces(); f++) {
+      fan.push_back(_mesh.last(f) - _mesh.first(f));
+    }
+    cout << "leaves: triangles per polygon";
+    histogram(cout, fan);
+    cout << endl;
+  }
+  _ltree.depths(depths);
+  if(!depths.empty()) {
+    cout << "depth: light tree leaves";
+    histogram(cout, depths);
+    cout << endl;
+  }
+
+  /* memory */
+  unsigned long sphere_bytes = _spheres.bytes() + _sphere_material.capacity() * sizeof(int);
+  unsigned long bound_bytes = _bounds.bytes() +
+      (_bound_first.capacity() + _bound_faces.capacity()) * sizeof(uint32_t);
+  unsigned long mesh_bytes = _mesh.bytes();
+  unsigned long light_bytes = _lights.capacity() * sizeof(light) + _ltree.bytes();
+  unsigned long material_bytes = _materials.capacity() * sizeof(material);
+  cout << "memory: spheres " << sphere_bytes / 1024 << " KiB, bounds " << bound_bytes / 1024
+       << " KiB, mesh " << mesh_bytes / 1024 << " KiB, lights " << light_bytes / 1024
+       << " KiB, materials " << material_bytes / 1024 << " KiB, total "
+       << (sphere_bytes + bound_bytes + mesh_bytes + light_bytes + material_bytes) / 1024 << " KiB"
+       << endl;
+
+  /* the objects whose polygons cost the most */
+  if(paged) {
+    cout << "worst: not available while the polygons are out of core" << endl;
+    return;
+  }
+
+  vector<double> cost(_mesh.objects(), 0);
+  vector<int> faces(_mesh.objects(), 0), groups(_mesh.objects(), 0), touching(_mesh.objects(), 0);
+  for(int g = 0; g < n_groups; g++) {
+    uint32_t o = _mesh.owner(_bound_faces[_bound_first[g]]);
+    cost[o]     += chance[g] * group_faces[g];
+    faces[o]    += group_faces[g];
+    groups[o]   += 1;
+    touching[o] += bound_overlaps[g];
+  }
+
+  vector<pair<double, int> > order;
+  for(uint32_t o = 0; o < _mesh.objects(); o++) {
+    if(groups[o] != 0) {
+      order.push_back(pair<double, int>(-cost[o], o));
+    }
+  }
+  sort(order.begin(), order.end());
+
+  for(unsigned int i = 0; i < order.size() && i < 5; i++) {
+    int o = order[i].second;
+    cout << "worst: object " << o << " (" << _mesh.object(o) << "), " << cost[o]
+         << " polygon tests per ray, " << faces[o] << " polygons in " << groups[o] << " groups, "
+         << touching[o] << " bound overlaps" << endl;
+  }
+}
+
+/**
+ * Tests the polygons of a list of groups when they are kept in the page file.
+ * Each chunk that is needed is held until every group has been tested. If a
+ * chunk is not in memory the rest are still tested so that every missing
+ * chunk is asked for at once, and page_cache::deferred is left set to say
+ * the result is not known.
+ *
+ * @param groups the groups the ray passes through
+ * @param U the direction of the ray
+ * @param L the origin of the ray
+ * @param skip the face the ray is leaving, -1 if none
+ * @param t the distance to beat, set to the distance to the new hit
+ * @param any stop at the first hit closer than t, the hit is then certain
+ * @return the face that was hit, -1 if none was closer than t
+ */
+int model::paged(const vector<int>& groups, const Vector<3>& U, const point& L, int skip,
+    double& t, bool any) const {
+  static thread_local vector<pair<int, const chunk*> > held;
+  bool before = page_cache::deferred;
+  int best = -1, idx;
+
+  held.clear();
+  for(auto iter = groups.begin(); iter != groups.end(); iter++) {
+    int c = _pages->chunk_of(*iter);
+    const chunk* data = NULL;
+    unsigned int h;
+
+    for(h = 0; h < held.size() && held[h].first != c; h++);
+    if(h == held.size()) {
+      held.push_back(pair<int, const chunk*>(c, _pages->acquire(c)));
+    }
+    if((data = held[h].second) == NULL) {
+      continue;
+    }
+
+    int n = _bound_first[*iter + 1] - _bound_first[*iter];
+    if((idx = data->nearest(_pages->start_of(*iter), n, U, L, skip, t)) >= 0) {
+      best = idx;
+      if(any) {
+        page_cache::deferred = before;
+        break;
+      }
+    }
+  }
+
+  for(auto iter = held.begin(); iter != held.end(); iter++) {
+    if(iter->second != NULL) {
+      _pages->release(iter->first);
+    }
+  }
+
+  return best;
+}
+
+/**
+ * @param h a surface that was hit
+ * @param p the point that was hit
+ * @return the normal of the surface at the point, not normalized
+ */
+Vector<3> model::normal(const hit& h, const point& p) const {
+  if(h.type == hit::sphere) {
+    return p - _spheres.center(h.index);
+  }
+  return _mesh.normal(h.index);
+}
+
+/**
+ * @param h a surface that was hit
+ * @return the index of the material of the surface
+ */
+int model::mat_index(const hit& h) const {
+  if(h.type == hit::sphere) {
+    return _sphere_material[h.index];
+  }
+  return _mesh.material(h.index);
 }
 
 material& model::mat(const string& name) {
-  if(_materials.find(name) == _materials.end())
+  if(_material_index.find(name) == _material_index.end())
     throw exception();
-  return _materials[name];
+  return _materials[_material_index[name]];
 }
 
 material model::mat(const string& name) const {
-  if(_materials.find(name) == _materials.end())
+  if(_material_index.find(name) == _material_index.end())
     throw exception();
-  return _materials.find(name)->second;
+  return _materials[_material_index.find(name)->second];
+}
+
+/**
+ * Replaces every light of the model and rebuilds the light tree. What the
+ * shadow cache knew about the old lights is thrown away.
+ *
+ * @param lights the new lights
+ */
+void model::relight(const vector<light>& lights) {
+  _lights = lights;
+  _ltree = light_tree(_lights);
+
+  if(_shadows != NULL) {
+    delete _shadows;
+    _shadows = new shadow_cache(this);
+  }
 }
 
 point light::direction(point src) const {
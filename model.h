@@ -12,8 +12,12 @@
 #ifndef MODEL_H_INCLUDE
 #define MODEL_H_INCLUDE
 
+#include <light_tree.h>
 #include <matrix.tpp>
+#include <mesh.h>
+#include <page_cache.h>
 #include <shape.h>
+#include <sphere_list.h>
 #include <surface.h>
 #include <object.h>
 #include <lexer.h>
@@ -26,6 +30,9 @@ using std::tuple;
 #include <vector>
 using std::vector;
 
+struct cull_list;
+class shadow_cache;
+
 class material {
   public:
     
@@ -65,6 +72,7 @@ class light {
     inline Vector<4> position() const { return _position; }
 
     point direction(point src) const;
+    inline bool directional() const { return _position[3] == 0; }
 
   protected:
     Vector<3> _illumination;
@@ -75,35 +83,68 @@ class light {
 class model {
   public:
 
-    typedef vector<sphere*>::iterator iterator;
-    typedef vector<sphere*>::const_iterator const_iterator;
     typedef vector<light>::iterator literator;
     typedef vector<light>::const_iterator const_literator;
 
     model(map<string, shape*> Shapes, vector<object*> objs, vector<light> lights, map<string, material> mats);
     virtual ~model();
 
-    inline iterator begin() { return _surfaces.begin(); }
-    inline const_iterator begin() const { return _surfaces.begin(); }
-    inline iterator end() { return _surfaces.end(); }
-    inline const_iterator end() const { return _surfaces.end(); }
     inline literator lbegin() { return _lights.begin(); }
     inline const_literator lbegin() const { return _lights.begin(); }
     inline literator lend() { return _lights.end(); }
     inline const_literator lend() const { return _lights.end(); }
     inline vector<light>& lights() { return _lights; }
     inline const vector<light>& lights() const { return _lights; }
-    inline int  size() const { return _surfaces.size(); }
-
+    inline const light_tree& ltree() const { return _ltree; }
+    inline int  size() const { return _spheres.size() + _bounds.size(); }
+    inline const mesh& polygons() const { return _mesh; }
+    inline bool has_spheres() const { return _spheres.size() != 0; }
+    inline bool has_polygons() const { return _bounds.size() != 0; }
+    bool specular() const;
+    bool translucent() const;
+    void analyze() const;
+    inline const sphere_list& spheres() const { return _spheres; }
+    inline const sphere_list& bounds() const { return _bounds; }
+    inline const uint32_t* group(int g) const { return &_bound_faces[_bound_first[g]]; }
+    inline int group_size(int g) const { return _bound_first[g + 1] - _bound_first[g]; }
+    inline const page_cache* pages() const { return _pages; }
+    inline shadow_cache* shadows() const { return _shadows; }
+
+    template<bool SPHERES = true, bool POLYGONS = true>
+    hit intersection(const Vector<3>& U, const point& L, const hit& skip) const;
+    template<bool SPHERES = true, bool POLYGONS = true>
+    hit intersection(const Vector<3>& U, const point& L, const cull_list& part) const;
+    template<bool SPHERES = true, bool POLYGONS = true>
+    bool occluded(const Vector<3>& U, const point& L, const hit& skip, double dist) const;
+    Vector<3> normal(const hit& h, const point& p) const;
+    int mat_index(const hit& h) const;
+
+    inline material& mat(int idx) { return _materials[idx]; }
+    inline const material& mat(int idx) const { return _materials[idx]; }
     material& mat(const string& name);
     material mat(const string& name) const;
+    void relight(const vector<light>& lights);
+
+    static bool stats;
 
   protected:
 
-    vector<sphere*>       _surfaces;
+    int nearest_face(const vector<int>& groups, const Vector<3>& U, const point& L, int skip, double& t) const;
+    int paged(const vector<int>& groups, const Vector<3>& U, const point& L, int skip, double& t, bool any) const;
+
+    sphere_list           _spheres;          ///< every sphere in the model
+    vector<int>           _sphere_material;  ///< the material of each sphere
+    sphere_list           _bounds;           ///< spheres that bound groups of polygons
+    vector<uint32_t>      _bound_first;      ///< first face of each group, plus one past the end
+    vector<uint32_t>      _bound_faces;      ///< the faces of every group
     vector<light>         _lights;
+    light_tree            _ltree;
     vector<int>           _illumination;
-    map<string, material> _materials;
+    vector<material>      _materials;
+    map<string, int>      _material_index;
+    mesh                  _mesh;
+    page_cache*           _pages;            ///< the polygons when they are out of core, NULL otherwise
+    shadow_cache*         _shadows;          ///< what each light sees, NULL unless shadow_cache::cells is set
 };
 
 lexer& operator>>(lexer& istr, material& m);
@@ -18,12 +18,6 @@ using std::cerr;
 using std::cout;
 using std::endl;
 
-object::~object() {
-  for(auto iter = _transforms.begin(); iter != _transforms.end(); iter++) {
-    delete *iter;
-  }
-}
-
 lexer& operator>>(lexer& istr, object& obj) {
   string curr;
 
@@ -32,7 +26,7 @@ lexer& operator>>(lexer& istr, object& obj) {
 
   for(istr >> curr; curr != "EndObject" && !istr.fail(); istr >> curr) {
     if(curr == "Scale") {
-      scale* s = new scale();
+      scale* s = obj.mem()->make<scale>();
       istr >> *s;
       obj.addTransform(s);
       if(obj.uniform()) {
@@ -43,11 +37,11 @@ lexer& operator>>(lexer& istr, object& obj) {
         }
       }
     } else if(curr == "Translate") {
-      translate* t = new translate();
+      translate* t = obj.mem()->make<translate>();
       istr >> *t;
       obj.addTransform(t);
     } else if(curr == "Rotate") {
-      rotate* r = new rotate();
+      rotate* r = obj.mem()->make<rotate>();
       istr >> *r;
       obj.addTransform(r);
     } else {
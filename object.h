@@ -12,6 +12,7 @@
 #ifndef OBJECT_H_INCLUDE
 #define OBJECT_H_INCLUDE
 
+#include <arena.h>
 #include <transform.h>
 #include <lexer.h>
 #include <matrix.tpp>
@@ -30,8 +31,8 @@ class object {
     typedef vector<Matrix<4, 4>* >::reverse_iterator reverse_iterator;
     typedef vector<Matrix<4, 4>* >::const_reverse_iterator const_reverse_iterator;
 
-    object() : _uniform_scale(1) { }
-    virtual ~object();
+    object(arena* mem) : _uniform_scale(1), _arena(mem) { }
+    virtual ~object() { }
 
     inline void addTransform(Matrix<4, 4>* trans) { _transforms.push_back(trans); }
 
@@ -55,13 +56,15 @@ class object {
     inline Matrix<4, 4>* operator[](int idx) { return _transforms[idx]; }
     inline const Matrix<4, 4>* operator[](int idx) const { return _transforms[idx]; }
     inline unsigned int size() const { return _transforms.size(); }
+    inline arena* mem() const { return _arena; }
 
   protected:
 
     double                 _uniform_scale;
     string                 _shape;
     string                 _material;
-    vector<Matrix<4, 4>* > _transforms;
+    vector<Matrix<4, 4>* > _transforms;     ///< owned by the arena
+    arena*                 _arena;          ///< the arena the transforms are made in
 };
 
 lexer& operator>>(lexer& istr, object& obj);
@@ -0,0 +1,425 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <page_cache.h>
+#include <heatmap.h>
+#include <trace.h>
+
+#include <algorithm>
+using std::max;
+using std::min;
+using std::sort;
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+using std::exception;
+#include <iostream>
+using std::cerr;
+using std::cout;
+using std::endl;
+#include <utility>
+using std::pair;
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* intialize statics */
+string        page_cache::file        = "";
+unsigned long page_cache::capacity    = 256ul << 20;
+unsigned long page_cache::chunk_bytes = 256ul << 10;
+
+thread_local bool page_cache::deferred = false;
+thread_local bool page_cache::blocking = false;
+
+/**
+ * Spreads the low 10 bits of a number out so there are two zero bits between
+ * each of them.
+ */
+static uint32_t spread(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x <<  8)) & 0x0300f00f;
+  x = (x | (x <<  4)) & 0x030c30c3;
+  x = (x | (x <<  2)) & 0x09249249;
+  return x;
+}
+
+/**
+ * Finds the closest face of a range of local faces that a ray hits, the same
+ * test as mesh::nearest().
+ *
+ * @param start the first local face of the range
+ * @param n the number of faces in the range
+ * @param U the direction of the ray
+ * @param L the origin of the ray
+ * @param skip the face of the mesh the ray is leaving, -1 if none
+ * @param t the distance to beat, set to the distance to the new hit
+ * @return the face of the mesh that was hit, -1 if none was closer than t
+ */
+int chunk::nearest(uint32_t start, int n, const Vector<3>& U, const point& L, int skip, double& t) const {
+  int best = -1;
+  double d;
+
+  for(uint32_t i = start; i < start + n; i++) {
+    if(int(face[i]) == skip) {
+      continue;
+    }
+
+    heatmap::intersections++;
+    for(uint32_t j = first[i]; j < first[i + 1]; j++) {
+      if(mesh::intersect(tri[3*j], tri[3*j + 1], tri[3*j + 2], U, L, d)) {
+        if(d > 0 && d < t) {
+          t = d;
+          best = face[i];
+        }
+        break;
+      }
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Splits the polygon groups of a model into chunks and writes them to the
+ * page file. Nothing is loaded until a worker asks for it.
+ *
+ * @param m the mesh that holds the polygons
+ * @param group_first the first face of each group, plus one past the end
+ * @param group_faces the faces of every group
+ * @param centers the center of the bounding sphere of each group
+ */
+page_cache::page_cache(const mesh& m, const vector<uint32_t>& group_first,
+    const vector<uint32_t>& group_faces, const vector<point>& centers) :
+    _entries(), _group_chunk(centers.size()), _group_start(centers.size()), _slots(NULL), _tick(0),
+    _fd(-1), _requests(), _memory(), _loader(NULL), _stop(false), _resident(0), _peak(0),
+    _misses(0), _evictions(0), _read(0), _waits(0) {
+  int n = centers.size();
+  point lo, hi;
+
+  /* order the groups along a Morton curve through their bounding box */
+  for(int i = 0; i < n; i++) {
+    for(int j = 0; j < 3; j++) {
+      lo[j] = i == 0 ? centers[i][j] : min(lo[j], centers[i][j]);
+      hi[j] = i == 0 ? centers[i][j] : max(hi[j], centers[i][j]);
+    }
+  }
+
+  vector<pair<uint32_t, int> > order;
+  for(int i = 0; i < n; i++) {
+    uint32_t code = 0;
+    for(int j = 0; j < 3; j++) {
+      double ext = hi[j] - lo[j];
+      uint32_t q = ext > 0 ? uint32_t((centers[i][j] - lo[j]) / ext * 1023) : 0;
+      code |= spread(q) << j;
+    }
+    order.push_back(pair<uint32_t, int>(code, i));
+  }
+  sort(order.begin(), order.end());
+
+  _fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(_fd < 0) {
+    cerr << "ERROR: could not create page file: " << file << endl;
+    throw exception();
+  }
+
+  /* pack the groups into chunks and write each one out */
+  unsigned long offset = 0;
+  vector<uint32_t> faces, first;
+  vector<point> tris;
+
+  for(int i = 0; i < n; i++) {
+    int g = order[i].second;
+
+    _group_chunk[g] = _entries.size();
+    _group_start[g] = faces.size();
+    for(uint32_t f = group_first[g]; f < group_first[g + 1]; f++) {
+      uint32_t face = group_faces[f];
+
+      faces.push_back(face);
+      first.push_back(tris.size() / 3);
+      for(uint32_t t = m.first(face); t < m.last(face); t++) {
+        tris.push_back(m.vertex(m.tri(t).v[0]));
+        tris.push_back(m.vertex(m.tri(t).v[1]));
+        tris.push_back(m.vertex(m.tri(t).v[2]));
+      }
+    }
+
+    unsigned long head = (8 + 4 * (2 * faces.size() + 1) + 7) & ~7ul;
+    unsigned long bytes = head + tris.size() * sizeof(point);
+    if(bytes < chunk_bytes && i + 1 != n) {
+      continue;
+    }
+
+    first.push_back(tris.size() / 3);
+    char* buf = (char*)calloc(1, bytes);
+    uint32_t counts[2] = { uint32_t(faces.size()), uint32_t(tris.size() / 3) };
+    memcpy(buf, counts, 8);
+    memcpy(buf + 8, &faces[0], 4 * faces.size());
+    memcpy(buf + 8 + 4 * faces.size(), &first[0], 4 * first.size());
+    memcpy(buf + head, &tris[0], tris.size() * sizeof(point));
+
+    if(pwrite(_fd, buf, bytes, offset) != ssize_t(bytes)) {
+      free(buf);
+      close(_fd);
+      unlink(file.c_str());
+      cerr << "ERROR: could not write page file: " << file << endl;
+      throw exception();
+    }
+    free(buf);
+
+    entry e;
+    e.offset = offset;
+    e.bytes  = bytes;
+    e.data   = NULL;
+    e.queued = false;
+    _entries.push_back(e);
+
+    offset += bytes;
+    faces.clear();
+    first.clear();
+    tris.clear();
+  }
+
+  _slots = new slot[_entries.size()]();
+  for(unsigned int c = 0; c < _entries.size(); c++) {
+    _slots[c].pins = -1;
+  }
+
+  _loader = new std::thread(&page_cache::load, this);
+}
+
+/**
+ * Stops the loader, frees every chunk and removes the page file.
+ */
+page_cache::~page_cache() {
+  {
+    std::unique_lock<std::mutex> ul(_lock);
+    _stop = true;
+    _wake.notify_all();
+  }
+  _loader->join();
+  delete _loader;
+
+  for(auto iter = _entries.begin(); iter != _entries.end(); iter++) {
+    free(iter->data);
+  }
+  delete[] _slots;
+
+  close(_fd);
+  unlink(file.c_str());
+}
+
+/**
+ * Gets a chunk for reading. The chunk stays in memory until it is given back
+ * with release(). If the chunk is not in memory a load is asked for, then
+ * unless blocking is set NULL is returned and deferred is set.
+ *
+ * @param c the index of the chunk
+ * @return the chunk, NULL if it is not in memory
+ */
+const chunk* page_cache::acquire(int c) {
+  slot& s = _slots[c];
+  int pins = s.pins.load(std::memory_order_relaxed);
+
+  while(pins >= 0) {
+    if(s.pins.compare_exchange_weak(pins, pins + 1, std::memory_order_acquire,
+        std::memory_order_relaxed)) {
+      return hit(c);
+    }
+  }
+
+  std::unique_lock<std::mutex> ul(_lock);
+  entry& e = _entries[c];
+
+  /* nothing is evicted while the lock is held, so a chunk found in memory here
+   * can be pinned outright */
+  if(s.pins.load(std::memory_order_acquire) >= 0) {
+    s.pins.fetch_add(1, std::memory_order_acquire);
+    return hit(c);
+  }
+
+  _misses++;
+
+  if(!blocking) {
+    if(!e.queued) {
+      e.queued = true;
+      _requests.push_back(c);
+      _wake.notify_one();
+    }
+    deferred = true;
+    return NULL;
+  }
+
+  _waits++;
+  long long start = trace::enabled ? trace::now() : 0;
+  while(s.pins.load(std::memory_order_acquire) < 0) {
+    if(!e.queued) {
+      e.queued = true;
+      _requests.push_front(c);
+      _wake.notify_one();
+    }
+    _loaded.wait(ul);
+  }
+  if(trace::enabled) trace::record("page wait", start, c);
+
+  s.pins.fetch_add(1, std::memory_order_acquire);
+  s.used.store(_tick.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  return &e.view;
+}
+
+/**
+ * Counts a hit on a chunk that has just been pinned and marks it as used.
+ *
+ * @param c the index of the chunk
+ * @return the chunk
+ */
+inline const chunk* page_cache::hit(int c) {
+  slot& s = _slots[c];
+  unsigned long now = _tick.load(std::memory_order_relaxed);
+
+  s.hits.fetch_add(1, std::memory_order_relaxed);
+  if(s.used.load(std::memory_order_relaxed) != now) {
+    s.used.store(now, std::memory_order_relaxed);
+  }
+  return &_entries[c].view;
+}
+
+/**
+ * Gives back a chunk that was returned by acquire().
+ *
+ * @param c the index of the chunk
+ */
+void page_cache::release(int c) {
+  _slots[c].pins.fetch_sub(1, std::memory_order_release);
+}
+
+/**
+ * Drops the least recently used chunks that are not being read until there
+ * is room for a new chunk. If every chunk in memory is being read the cache
+ * is allowed to go over its capacity.
+ *
+ * @param bytes the size of the chunk that needs room
+ */
+void page_cache::evict(unsigned long bytes) {
+  if(_resident + bytes <= capacity) {
+    return;
+  }
+
+  /* the workers keep marking chunks while this runs, so sort a copy of the marks */
+  vector<pair<unsigned long, int> > order;
+  for(auto iter = _memory.begin(); iter != _memory.end(); iter++) {
+    unsigned long used = _slots[*iter].used.load(std::memory_order_relaxed);
+    order.push_back(pair<unsigned long, int>(used, *iter));
+  }
+  sort(order.begin(), order.end());
+
+  for(auto iter = order.begin(); iter != order.end() && _resident + bytes > capacity; iter++) {
+    entry& e = _entries[iter->second];
+    int none = 0;
+
+    if(_slots[iter->second].pins.compare_exchange_strong(none, -1, std::memory_order_acquire)) {
+      free(e.data);
+      e.data = NULL;
+      _resident -= e.bytes;
+      _evictions++;
+    }
+  }
+
+  unsigned int kept = 0;
+  for(unsigned int i = 0; i < _memory.size(); i++) {
+    if(_entries[_memory[i]].data != NULL) {
+      _memory[kept++] = _memory[i];
+    }
+  }
+  _memory.resize(kept);
+}
+
+/**
+ * The loader thread. Reads the chunks that have been asked for, one at a
+ * time, while the workers keep tracing other rays.
+ */
+void page_cache::load() {
+  trace::thread_name("loader");
+
+  for(;;) {
+    std::unique_lock<std::mutex> ul(_lock);
+    while(!_stop && _requests.empty()) {
+      _wake.wait(ul);
+    }
+    if(_stop) {
+      return;
+    }
+
+    int c = _requests.front();
+    _requests.pop_front();
+    entry& e = _entries[c];
+    if(e.data != NULL) {
+      e.queued = false;
+      continue;
+    }
+
+    unsigned long offset = e.offset, bytes = e.bytes;
+    ul.unlock();
+
+    trace_span span("page in", c);
+    char* buf = (char*)malloc(bytes);
+    for(unsigned long done = 0; done < bytes;) {
+      ssize_t r = pread(_fd, buf + done, bytes - done, offset + done);
+      if(r <= 0) {
+        cerr << "ERROR: could not read page file: " << file << endl;
+        abort();
+      }
+      done += r;
+    }
+
+    ul.lock();
+    evict(bytes);
+
+    uint32_t counts[2];
+    memcpy(counts, buf, 8);
+    e.view.n_faces = counts[0];
+    e.view.face    = (const uint32_t*)(buf + 8);
+    e.view.first   = e.view.face + counts[0];
+    e.view.tri     = (const point*)(buf + ((8 + 4 * (2 * counts[0] + 1) + 7) & ~7ul));
+    e.data   = buf;
+    e.queued = false;
+    _memory.push_back(c);
+
+    _resident += bytes;
+    _peak = max(_peak, _resident);
+    _read += bytes;
+    unsigned long now = _tick.fetch_add(1, std::memory_order_relaxed) + 1;
+    _slots[c].used.store(now, std::memory_order_relaxed);
+    _slots[c].pins.store(0, std::memory_order_release);
+    _loaded.notify_all();
+  }
+}
+
+/**
+ * Prints how well the cache worked.
+ */
+void page_cache::report() const {
+  std::unique_lock<std::mutex> ul(_lock);
+  unsigned long hits = 0;
+  for(unsigned int c = 0; c < _entries.size(); c++) {
+    hits += _slots[c].hits.load(std::memory_order_relaxed);
+  }
+  unsigned long total = hits + _misses;
+  unsigned long file_bytes = _entries.empty() ? 0 : _entries.back().offset + _entries.back().bytes;
+
+  cout << "pages: " << _entries.size() << " chunks, " << file_bytes / 1024 << " KiB on disk, "
+       << capacity / 1024 << " KiB cache, " << _peak / 1024 << " KiB peak resident" << endl;
+  cout << "pages: " << hits << " hits, " << _misses << " misses ("
+       << (total ? 100.0 * hits / total : 100.0) << "% hit rate), " << _tick.load() << " loads, "
+       << _evictions << " evictions, " << _read / 1024 << " KiB read, " << _waits << " blocking waits"
+       << endl;
+}
@@ -0,0 +1,133 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef PAGE_CACHE_H_INCLUDE
+#define PAGE_CACHE_H_INCLUDE
+
+#include <mesh.h>
+#include <Vector.tpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+using std::string;
+#include <thread>
+#include <vector>
+using std::vector;
+
+/**
+ * The triangles of some of the polygon groups of a model, as read from the
+ * page file. The faces of each group are contiguous. The vertices of every
+ * triangle are stored inline so a chunk needs nothing else to be tested.
+ */
+struct chunk {
+  uint32_t        n_faces;  ///< number of faces in the chunk
+  const uint32_t* face;     ///< the face of the mesh for each local face
+  const uint32_t* first;    ///< first triangle of each local face, plus one past the end
+  const point*    tri;      ///< three vertices per triangle
+
+  int nearest(uint32_t start, int n, const Vector<3>& U, const point& L, int skip, double& t) const;
+};
+
+/**
+ * Out of core storage for the polygons of a model. The polygon groups are
+ * sorted along a Morton curve and packed into chunks of about chunk_bytes, so
+ * each chunk covers a compact part of the scene. The chunks are written to a
+ * page file and read back into a cache that holds at most capacity bytes, the
+ * least recently used chunk that is not being read is evicted first.
+ *
+ * A chunk that is in memory is pinned and unpinned with atomic counts, so
+ * workers only take the lock on a miss. The loader frees a chunk only if it
+ * can take its count from 0 to -1, which a worker never pins. How recently a
+ * chunk was used is only known to within a load, each acquire marks the chunk
+ * with the number of loads done so far.
+ *
+ * Reads are done by a loader thread. A worker that needs a chunk that is not
+ * in memory asks for it to be loaded and gets NULL back, the thread local
+ * deferred flag is set so that the ray can be put back in the queue and
+ * retried later instead of waiting on the disk. A worker that sets blocking
+ * waits for the load instead, this is used for rays that have been deferred
+ * too many times so that a small cache cannot starve them.
+ *
+ * @file page_cache.h
+ */
+class page_cache {
+  public:
+
+    page_cache(const mesh& m, const vector<uint32_t>& group_first, const vector<uint32_t>& group_faces,
+        const vector<point>& centers);
+    virtual ~page_cache();
+
+    const chunk* acquire(int c);
+    void release(int c);
+
+    inline int chunk_of(int group) const { return _group_chunk[group]; }
+    inline uint32_t start_of(int group) const { return _group_start[group]; }
+    inline int chunks() const { return _entries.size(); }
+
+    void report() const;
+
+    static string        file;
+    static unsigned long capacity;
+    static unsigned long chunk_bytes;
+
+    static thread_local bool deferred;
+    static thread_local bool blocking;
+
+  protected:
+
+    /** a chunk in the page file and its state in the cache */
+    struct entry {
+      unsigned long offset;   ///< where the chunk starts in the page file
+      unsigned long bytes;    ///< size of the chunk in the page file
+      char*         data;     ///< the chunk when it is in memory, NULL if it is not
+      chunk         view;     ///< pointers into data
+      bool          queued;   ///< a load has been asked for
+    };
+
+    /** what the workers change about a chunk without taking the lock */
+    struct slot {
+      std::atomic<int>           pins;  ///< workers reading the chunk, -1 when not in memory
+      std::atomic<unsigned long> used;  ///< the value of _tick when it was last acquired
+      std::atomic<unsigned long> hits;  ///< acquires that found the chunk in memory
+    };
+
+    const chunk* hit(int c);
+    void load();
+    void evict(unsigned long bytes);
+
+    vector<entry>    _entries;      ///< every chunk
+    vector<int>      _group_chunk;  ///< the chunk that holds each group
+    vector<uint32_t> _group_start;  ///< the first local face of each group in its chunk
+    slot*            _slots;        ///< the pins of every chunk
+    std::atomic<unsigned long> _tick; ///< chunks loaded so far, the clock for slot::used
+    int              _fd;           ///< the page file
+
+    mutable std::mutex      _lock;     ///< protects everything below
+    std::condition_variable _wake;     ///< signals the loader that there is work
+    std::condition_variable _loaded;   ///< signals blocked workers that a chunk arrived
+    std::deque<int>         _requests; ///< chunks waiting to be loaded
+    vector<int>             _memory;   ///< chunks in memory
+    std::thread*            _loader;   ///< the thread that reads chunks
+    bool                    _stop;     ///< tells the loader to exit
+
+    unsigned long _resident;  ///< bytes of chunks in memory
+    unsigned long _peak;      ///< most bytes that were in memory at once
+    unsigned long _misses;    ///< acquires that did not
+    unsigned long _evictions; ///< chunks dropped from memory
+    unsigned long _read;      ///< bytes read from the page file
+    unsigned long _waits;     ///< misses that blocked the worker
+};
+
+#endif /* PAGE_CACHE_H_INCLUDE */
@@ -0,0 +1,325 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <pool.h>
+#include <trace.h>
+
+#include <algorithm>
+using std::max;
+#include <cstdlib>
+#include <fstream>
+using std::ifstream;
+#include <iostream>
+using std::cerr;
+using std::cout;
+using std::endl;
+#include <sstream>
+using std::ostringstream;
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_NODES 64
+#define POLICY_DEFAULT 0
+#define POLICY_INTERLEAVE 3
+
+/* intialize statics */
+int    pool::threads  = 0;
+string pool::affinity = "none";
+
+/**
+ * Reads a list of cpus in the form used by the kernel, "0-3,8,10-11".
+ *
+ * @param list the text of the list
+ * @return the cpus in the order they were listed, empty if the list is bad
+ */
+static vector<int> cpu_list(const string& list) {
+  vector<int> ret;
+  std::istringstream istr(list);
+  string range;
+
+  while(std::getline(istr, range, ',')) {
+    char* end;
+    long lo = strtol(range.c_str(), &end, 10), hi = lo;
+    if(end == range.c_str()) {
+      return vector<int>();
+    }
+    if(*end == '-') {
+      hi = strtol(end + 1, &end, 10);
+    }
+    if(*end != '\0' && *end != '\n') {
+      return vector<int>();
+    }
+    for(long c = lo; c <= hi; c++) {
+      ret.push_back(c);
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * @return the process wide pool, started the first time this is called
+ */
+pool& pool::workers() {
+  static pool p;
+  return p;
+}
+
+/**
+ * Finds the cpus and NUMA nodes the process may use and starts the workers.
+ */
+pool::pool() :
+    _threads(), _cpu(), _node(), _n_nodes(1), _mask(0), _job(NULL), _round(0), _active(0),
+    _stop(false), _jobs(0) {
+  int n = threads > 0 ? threads : max(int(std::thread::hardware_concurrency()) - 1, 1);
+  cpu_set_t allowed;
+  vector<vector<int> > groups;
+  vector<int> ids;
+
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  /* the cpus of each node that we are allowed to run on */
+  vector<int> node_of(CPU_SETSIZE, -1);
+  for(int i = 0; i < MAX_NODES; i++) {
+    ostringstream name;
+    name << "/sys/devices/system/node/node" << i << "/cpulist";
+    ifstream file(name.str().c_str());
+    string list;
+    if(!std::getline(file, list)) {
+      continue;
+    }
+
+    vector<int> cpus;
+    vector<int> all = cpu_list(list);
+    for(auto iter = all.begin(); iter != all.end(); iter++) {
+      if(*iter < CPU_SETSIZE && CPU_ISSET(*iter, &allowed)) {
+        cpus.push_back(*iter);
+        node_of[*iter] = groups.size();
+      }
+    }
+    if(!cpus.empty()) {
+      groups.push_back(cpus);
+      ids.push_back(i);
+    }
+  }
+  if(groups.empty()) {
+    groups.push_back(vector<int>());
+    for(int c = 0; c < CPU_SETSIZE; c++) {
+      if(CPU_ISSET(c, &allowed)) {
+        groups[0].push_back(c);
+        node_of[c] = 0;
+      }
+    }
+  }
+
+  /* pick a cpu for each worker */
+  vector<int> order;
+  if(affinity == "compact") {
+    for(auto iter = groups.begin(); iter != groups.end(); iter++) {
+      order.insert(order.end(), iter->begin(), iter->end());
+    }
+  } else if(affinity == "numa") {
+    for(unsigned int j = 0; order.size() < (unsigned int)CPU_SETSIZE; j++) {
+      bool any = false;
+      for(auto iter = groups.begin(); iter != groups.end(); iter++) {
+        if(j < iter->size()) {
+          order.push_back((*iter)[j]);
+          any = true;
+        }
+      }
+      if(!any) {
+        break;
+      }
+    }
+  } else if(affinity != "none") {
+    order = cpu_list(affinity);
+    if(order.empty()) {
+      cerr << "ERROR: bad affinity: " << affinity << ", workers are not pinned" << endl;
+    }
+  }
+
+  vector<bool> used(groups.size(), false);
+  for(int i = 0; i < n; i++) {
+    int cpu = order.empty() ? -1 : order[i % order.size()];
+    _cpu.push_back(cpu);
+    _node.push_back(cpu >= 0 && cpu < CPU_SETSIZE ? node_of[cpu] : -1);
+    if(_node.back() >= 0) {
+      used[_node.back()] = true;
+    }
+  }
+  _n_nodes = max(int(std::count(used.begin(), used.end(), true)), 1);
+
+  /* only the nodes the workers run on share the model, see interleave() */
+  for(unsigned int g = 0; g < ids.size(); g++) {
+    if(used[g]) {
+      _mask |= 1ul << ids[g];
+    }
+  }
+
+  for(int i = 0; i < n; i++) {
+    _threads.push_back(new std::thread(&pool::run, this, i));
+    pin(i);
+  }
+}
+
+/**
+ * Stops and joins the workers, they must not be running a job.
+ */
+pool::~pool() {
+  {
+    std::unique_lock<std::mutex> ul(_lock);
+    _stop = true;
+    _go.notify_all();
+  }
+
+  for(auto iter = _threads.begin(); iter != _threads.end(); iter++) {
+    (*iter)->join();
+    delete *iter;
+  }
+}
+
+/**
+ * Pins a worker to its cpu.
+ *
+ * @param i the index of the worker
+ */
+void pool::pin(int i) {
+  if(_cpu[i] < 0 || _cpu[i] >= CPU_SETSIZE) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(_cpu[i], &set);
+  if(pthread_setaffinity_np(_threads[i]->native_handle(), sizeof(set), &set) != 0) {
+    cerr << "ERROR: could not pin worker " << i << " to cpu " << _cpu[i] << endl;
+  }
+}
+
+/**
+ * Has every worker run a job once. Returns right away, wait() blocks until
+ * all of them have returned from it.
+ *
+ * @param job the function the workers run
+ */
+void pool::start(void (*job)()) {
+  std::unique_lock<std::mutex> ul(_lock);
+
+  while(_active != 0) {
+    _idle.wait(ul);
+  }
+
+  _job = job;
+  _active = _threads.size();
+  _round++;
+  _jobs++;
+  _go.notify_all();
+}
+
+/**
+ * Blocks until every worker has finished the current job.
+ */
+void pool::wait() {
+  std::unique_lock<std::mutex> ul(_lock);
+
+  while(_active != 0) {
+    _idle.wait(ul);
+  }
+}
+
+/**
+ * @return true while any worker is still running the current job
+ */
+bool pool::busy() {
+  std::unique_lock<std::mutex> ul(_lock);
+  return _active != 0;
+}
+
+/**
+ * A worker thread, runs each job it is given until the pool is destroyed.
+ *
+ * @param i the index of the worker
+ */
+void pool::run(int i) {
+  ostringstream name;
+  name << "worker " << i;
+  trace::thread_name(name.str());
+
+  unsigned long seen = 0;
+  for(;;) {
+    void (*job)();
+
+    {
+      std::unique_lock<std::mutex> ul(_lock);
+      while(!_stop && _round == seen) {
+        _go.wait(ul);
+      }
+      if(_stop) {
+        return;
+      }
+      seen = _round;
+      job = _job;
+    }
+
+    job();
+
+    std::unique_lock<std::mutex> ul(_lock);
+    if(--_active == 0) {
+      _idle.notify_all();
+    }
+  }
+}
+
+/**
+ * Sets the memory policy of the calling thread. While it is on, the pages the
+ * thread touches for the first time are spread round robin over the nodes the
+ * workers run on. Does nothing unless the workers are pinned and span more
+ * than one node. Pages already in memory are not moved.
+ *
+ * @param on true to interleave, false to go back to the default policy
+ */
+void pool::interleave(bool on) {
+  if(affinity == "none") {
+    return;
+  }
+
+  pool& p = workers();
+  if(p._n_nodes < 2) {
+    return;
+  }
+
+  if(on) {
+    syscall(SYS_set_mempolicy, POLICY_INTERLEAVE, &p._mask, sizeof(p._mask) * 8 + 1);
+  } else {
+    syscall(SYS_set_mempolicy, POLICY_DEFAULT, NULL, 0);
+  }
+}
+
+/**
+ * Prints where the workers are running.
+ */
+void pool::report() const {
+  cout << "pool: " << _threads.size() << " workers, affinity " << affinity << ", "
+       << _n_nodes << " numa node" << (_n_nodes == 1 ? "" : "s") << ", " << _jobs << " jobs";
+
+  if(!_cpu.empty() && _cpu[0] >= 0) {
+    cout << ", cpus";
+    for(unsigned int i = 0; i < _cpu.size(); i++) {
+      cout << " " << _cpu[i] << "/n" << _node[i];
+    }
+  }
+
+  cout << endl;
+}
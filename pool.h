@@ -0,0 +1,85 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef POOL_H_INCLUDE
+#define POOL_H_INCLUDE
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+using std::string;
+#include <thread>
+#include <vector>
+using std::vector;
+
+/**
+ * The worker threads of the process. The pool is started the first time it
+ * is used and its threads live until the process exits, every render hands
+ * them a job instead of creating and joining threads of its own.
+ *
+ * Workers can be pinned to cores. The affinity is one of
+ *   none     the scheduler places the threads (default)
+ *   compact  fill the cores of one NUMA node before the next
+ *   numa     deal the threads round robin across the NUMA nodes
+ *   a list   of cpus such as "0-7,16-23", used in that order
+ *
+ * When pinned workers span more than one node, interleave() makes the model
+ * be built with its pages interleaved across those nodes, so no single node
+ * serves every read of it. That is the only NUMA placement done, the model is
+ * not copied to each node since every ray holds the one model pointer. How
+ * this scales from one socket to two has not been measured.
+ *
+ * @file pool.h
+ */
+class pool {
+  public:
+
+    static pool& workers();
+
+    void start(void (*job)());
+    void wait();
+    bool busy();
+
+    inline int size() const { return _threads.size(); }
+    inline int nodes() const { return _n_nodes; }
+
+    void report() const;
+
+    static void interleave(bool on);
+
+    static int    threads;
+    static string affinity;
+
+  protected:
+
+    pool();
+    virtual ~pool();
+
+    void run(int i);
+    void pin(int i);
+
+    vector<std::thread*> _threads;  ///< the workers
+    vector<int>          _cpu;      ///< the cpu each worker is pinned to, -1 if none
+    vector<int>          _node;     ///< the node of each worker's cpu, -1 if none
+    int                  _n_nodes;  ///< number of nodes the workers are pinned to
+    unsigned long        _mask;     ///< the nodes the workers are pinned to
+
+    std::mutex              _lock;     ///< protects everything below
+    std::condition_variable _go;       ///< signals the workers that there is a job
+    std::condition_variable _idle;     ///< signals wait() that the last worker finished
+    void                  (*_job)();   ///< the job every worker runs
+    unsigned long           _round;    ///< incremented for every job
+    int                     _active;   ///< workers still running the job
+    bool                    _stop;     ///< tells the workers to exit
+    unsigned long           _jobs;     ///< jobs run so far
+};
+
+#endif /* POOL_H_INCLUDE */
@@ -12,8 +12,14 @@
 #ifndef QUEUE_TPP_INCLUDE
 #define QUEUE_TPP_INCLUDE
 
-#include <thread>
+#include <trace.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
 #include <deque>
+#include <mutex>
+#include <thread>
 
 /**
  * A simple concurrent queue implementation. This is by definition thread-safe.
@@ -26,6 +32,21 @@
  * If the functor returns true, it will be placed back in the queue, otherwise
  * it will be deleted.
  *
+ * Elements come out in the order they went in unless the queue is ordered.
+ * An ordered queue keeps a list for each power of two of priority(), an
+ * element comes out of the list with the largest priorities that is not
+ * empty, in the order it went in. Elements with a priority of 1 or more share
+ * the first list. An element that is placed back is ordered by its priority
+ * at that time.
+ *
+ * Normally every element is pushed before the workers start and a worker
+ * returns as soon as the queue is empty. A producer that pushes while the
+ * workers run calls open() first, the workers then wait for more elements
+ * until close() is called.
+ *
+ * When tracing is enabled every wait on the queue's lock is recorded on the
+ * timeline of the worker thread.
+ *
  * @file queue.tpp
  */
 template<typename T>
@@ -35,7 +56,7 @@ class concurrent_queue {
     typedef typename std::deque<T*>::iterator       iterator;
     typedef typename std::deque<T*>::const_iterator const_iterator;
 
-    concurrent_queue() { }
+    concurrent_queue() : _open(false), _ordered(false), _count(0), _top(0) { }
     virtual ~concurrent_queue() { }
 
     inline iterator       begin()       { return _queue.begin(); }
@@ -44,14 +65,28 @@ class concurrent_queue {
     inline const_iterator   end() const { return _queue.end();   }
 
     void push(T* t);
+    void open();
+    void close();
+    void order(bool ordered);
 
-    unsigned int size() const { return _queue.size(); }
+    unsigned int size() const { return _queue.size() + _count; }
     void worker();
 
   protected:
 
-    std::mutex       _lock;
-    std::deque<T*>   _queue;
+    static const int LEVELS = 64;  ///< lists of an ordered queue
+
+    void put(T* t);
+    T* take();
+
+    std::mutex                  _lock;
+    std::condition_variable_any _more;    ///< signaled when an element is pushed or the queue closes
+    std::deque<T*>              _queue;   ///< the elements when not ordered
+    std::deque<T*>              _levels[LEVELS]; ///< the elements when ordered, largest priorities first
+    bool                        _open;    ///< a producer is still pushing
+    bool                        _ordered; ///< elements come out by priority
+    unsigned int                _count;   ///< elements in the lists
+    int                         _top;     ///< no list before this one has elements
 };
 
 /**
@@ -62,7 +97,86 @@ class concurrent_queue {
 template<typename T>
 void concurrent_queue<T>::push(T* t) {
   std::unique_lock<std::mutex> ul(_lock);
-  _queue.push_back(t);
+  put(t);
+  if(_open) {
+    _more.notify_one();
+  }
+}
+
+/**
+ * Picks the order elements come out in, only while the queue is empty.
+ *
+ * @param ordered true to take the largest priority() first, false for the
+ *        order they were put in
+ */
+template<typename T>
+void concurrent_queue<T>::order(bool ordered) {
+  std::unique_lock<std::mutex> ul(_lock);
+  _ordered = ordered;
+}
+
+/**
+ * Puts an element in the queue, the lock must be held.
+ *
+ * @param t the element
+ */
+template<typename T>
+void concurrent_queue<T>::put(T* t) {
+  if(_ordered) {
+    double p = t->priority();
+    int level = p >= 1 ? 0 : p > 0 ? std::min(-std::ilogb(p), LEVELS - 1) : LEVELS - 1;
+    _levels[level].push_back(t);
+    _top = std::min(_top, level);
+    _count++;
+  } else {
+    _queue.push_back(t);
+  }
+}
+
+/**
+ * Takes the next element out of the queue, the lock must be held and the
+ * queue must not be empty.
+ *
+ * @return the element
+ */
+template<typename T>
+T* concurrent_queue<T>::take() {
+  T* ret;
+
+  if(_count != 0) {
+    while(_levels[_top].empty()) {
+      _top++;
+    }
+    ret = _levels[_top].front();
+    _levels[_top].pop_front();
+    _count--;
+  } else {
+    ret = _queue.front();
+    _queue.pop_front();
+  }
+
+  return ret;
+}
+
+/**
+ * Tells the workers that more elements are coming, they wait on an empty queue
+ * instead of returning.
+ */
+template<typename T>
+void concurrent_queue<T>::open() {
+  std::unique_lock<std::mutex> ul(_lock);
+  _open = true;
+}
+
+/**
+ * Tells the workers that nothing else will be pushed, they return once the
+ * queue is empty.
+ */
+template<typename T>
+void concurrent_queue<T>::close() {
+  std::unique_lock<std::mutex> ul(_lock);
+  _open = false;
+  _more.notify_all();
 }
 
 /**
@@ -73,22 +187,33 @@ void concurrent_queue<T>::push(T* t) {
  */
 template<typename T>
 void concurrent_queue<T>::worker() {
+  trace_span span("worker");
+  long long start;
   T* ret;
 
-  while(size() != 0) {
+  while(size() != 0 || _open) {
     {
+      start = trace::enabled ? trace::now() : 0;
       std::unique_lock<std::mutex> ul(_lock);
+      while(size() == 0 && _open) {
+        _more.wait(ul);
+      }
+      if(trace::enabled) trace::record("wait", start);
       if(size() != 0) {
-        ret = _queue.front();
-        _queue.pop_front();
+        ret = take();
       } else {
         break;
       }
     }
 
     if(ret->operator()()) {
+      start = trace::enabled ? trace::now() : 0;
       std::unique_lock<std::mutex> ul(_lock);
-      _queue.push_back(ret);
+      if(trace::enabled) trace::record("wait", start);
+      put(ret);
+      if(_open) {
+        _more.notify_one();
+      }
     } else {
       delete ret;
     }
@@ -0,0 +1,142 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <raster.h>
+#include <camera.h>
+#include <frustum.h>
+#include <model.h>
+#include <trace.h>
+
+#include <iostream>
+using std::cout;
+using std::endl;
+#include <limits>
+using std::numeric_limits;
+
+/* intialize statics */
+bool raster::enabled = false;
+
+/**
+ * Draws a model into the id buffer of a camera's image.
+ *
+ * @param m the model to draw, its polygons must be in memory
+ * @param c the camera to draw it for
+ */
+raster::raster(const model* m, const camera* c) :
+    _m(m), _c(c), _width(c->umax() - c->umin() + 1), _height(c->vmax() - c->vmin() + 1),
+    _ids(_width * _height, hit::miss(numeric_limits<double>::infinity())), _tests(0), _draw(0) {
+  trace_span span("raster");
+  long long start = trace::now();
+  const sphere_list& spheres = m->spheres();
+  const sphere_list& bounds = m->bounds();
+  Vector<3> U;
+  point L;
+  int box[4];
+
+  /* the spheres first and in order, on a tie the lower index wins */
+  for(int k = 0; k < spheres.size(); k++) {
+    if(!frustum::project(c, spheres.center(k), spheres.radius(k), box)) {
+      continue;
+    }
+
+    for(int row = box[2]; row <= box[3]; row++) {
+      for(int col = box[0]; col <= box[1]; col++) {
+        hit& h = _ids[row * _width + col];
+
+        primary(col, row, U, L);
+        if(spheres.hits(k, U, L, h.t)) {
+          h.type  = hit::sphere;
+          h.index = k;
+        }
+      }
+    }
+    _tests += (box[1] - box[0] + 1) * (box[3] - box[2] + 1);
+  }
+
+  /* then each group of polygons whose bound the ray passes through */
+  for(int g = 0; g < bounds.size(); g++) {
+    if(!frustum::project(c, bounds.center(g), bounds.radius(g), box)) {
+      continue;
+    }
+
+    for(int row = box[2]; row <= box[3]; row++) {
+      for(int col = box[0]; col <= box[1]; col++) {
+        hit& h = _ids[row * _width + col];
+        int idx;
+
+        primary(col, row, U, L);
+        if(bounds.passes(g, U, L) &&
+            (idx = m->polygons().nearest(m->group(g), m->group_size(g), U, L, -1, h.t)) >= 0) {
+          h.type  = hit::polygon;
+          h.index = idx;
+        }
+      }
+    }
+    _tests += (box[1] - box[0] + 1) * (box[3] - box[2] + 1);
+  }
+
+  _draw = (trace::now() - start) / 1e6;
+}
+
+/**
+ * Computes the primary ray of a pixel exactly the way camera::generate() does.
+ *
+ * @param col the column of the pixel in the image
+ * @param row the row of the pixel in the image
+ * @param U set to the direction of the ray
+ * @param L set to the origin of the ray
+ */
+void raster::primary(int col, int row, Vector<3>& U, point& L) const {
+  int x = col + _c->umin(), y = _c->vmax() - row;
+
+  L = _c->vrp() + x*_c->u() + y*_c->v();
+  U = L - _c->focal_point(); U.normalize();
+}
+
+/**
+ * Fills a g-buffer with the first hits, with the point, normal and material
+ * of each the same as shading the primary ray would record.
+ *
+ * @param g the g-buffer, the same size as the image
+ */
+void raster::fill(gbuffer& g) const {
+  Vector<3> U;
+  point L;
+
+  for(int row = 0; row < _height; row++) {
+    for(int col = 0; col < _width; col++) {
+      int i = row * _width + col;
+      gbuffer::sample& s = g[i];
+
+      s.h = _ids[i];
+      if(s.h.type != hit::none) {
+        primary(col, row, U, L);
+        s.p = s.h.at(U, L);
+        s.n = _m->normal(s.h, s.p);
+        s.material = _m->mat_index(s.h);
+      }
+    }
+  }
+}
+
+/**
+ * Prints how much drawing the model cost.
+ */
+void raster::report() const {
+  unsigned long covered = 0;
+  for(auto iter = _ids.begin(); iter != _ids.end(); iter++) {
+    covered += iter->type != hit::none;
+  }
+
+  cout << "raster: " << _width << "x" << _height << ", " << _tests << " pixel tests ("
+       << double(_tests) / _ids.size() << " per pixel), " << 100.0 * covered / _ids.size()
+       << "% of pixels hit, " << _draw << " ms" << endl;
+}
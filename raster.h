@@ -0,0 +1,65 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef RASTER_H_INCLUDE
+#define RASTER_H_INCLUDE
+
+#include <gbuffer.h>
+#include <surface.h>
+#include <Vector.tpp>
+
+#include <vector>
+using std::vector;
+
+class camera;
+class model;
+
+/**
+ * Finds what the primary ray of every pixel hits by drawing the model instead
+ * of tracing a ray per pixel. Each sphere, and the bounding sphere of each
+ * group of polygons, is projected onto the image and only the pixels inside
+ * its box are tested against it. The nearest hit of each pixel is kept in an
+ * id buffer, like a z-buffer that keeps the primitive along with the depth.
+ *
+ * The coverage of a pixel is decided by the same tests the ray tracer uses,
+ * done in the same order, so the id buffer holds exactly the hits that the
+ * primary rays would have found. The out of core polygons of a paged model
+ * cannot be drawn.
+ *
+ * @file raster.h
+ */
+class raster {
+  public:
+
+    raster(const model* m, const camera* c);
+    virtual ~raster() { }
+
+    inline const hit& operator[](int pixel) const { return _ids[pixel]; }
+    void fill(gbuffer& g) const;
+    void report() const;
+
+    static bool enabled;
+
+  protected:
+
+    void primary(int col, int row, Vector<3>& U, point& L) const;
+
+    const model*  _m;       ///< the model that was drawn
+    const camera* _c;       ///< the camera it was drawn for
+    int           _width;   ///< width of the image in pixels
+    int           _height;  ///< height of the image in pixels
+    vector<hit>   _ids;     ///< the nearest hit of each pixel
+
+    unsigned long _tests;   ///< pixels tested against a sphere or bound
+    double        _draw;    ///< time taken to draw in ms
+};
+
+#endif /* RASTER_H_INCLUDE */
@@ -0,0 +1,494 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <shadow_cache.h>
+#include <model.h>
+#include <trace.h>
+
+#include <algorithm>
+using std::max;
+using std::min;
+#include <cmath>
+#include <iostream>
+using std::cout;
+using std::endl;
+
+#define HALF_DIAGONAL 0.8660254037844386
+
+/* intialize statics */
+int  shadow_cache::cells = 0;
+bool shadow_cache::check = false;
+
+/**
+ * @param p a point
+ * @param a the start of a segment
+ * @param b the end of the segment
+ * @return the distance from p to the closest point of the segment
+ */
+static double segment_distance(const point& p, const point& a, const point& b) {
+  Vector<3> ab = b - a;
+  double len = ab.dot(ab);
+  double t = len > 0 ? max(0.0, min(1.0, (p - a).dot(ab) / len)) : 0;
+
+  return p.distance(a + t * ab);
+}
+
+/**
+ * Lays the grid over the bounds of a model, no bricks are made yet.
+ *
+ * @param m the model, its geometry must not change while the cache is used
+ */
+shadow_cache::shadow_cache(const model* m) :
+    _model(m), _lo(0), _side(1), _margin(0), _per(0), _spheres(m->spheres().size()),
+    _lights(m->lights().size()), _cells(NULL), _near(NULL), _bricks(0), _built(0), _crowded(0), _lit(0), _dark(0), _traced(0), _checked(0),
+    _wrong(0), _build(0) {
+  const sphere_list& spheres = m->spheres();
+  const sphere_list& bounds = m->bounds();
+  point hi(0);
+  bool any = false;
+
+  for(int s = 0; s < 4; s++) {
+    _states[s] = 0;
+  }
+  for(int a = 0; a < 3; a++) {
+    _n[a] = _b[a] = 0;
+  }
+
+  /* the polygons of a group are all inside its bound */
+  for(int i = 0; i < spheres.size() + bounds.size(); i++) {
+    bool sphere = i < spheres.size();
+    point c = sphere ? spheres.center(i) : bounds.center(i - spheres.size());
+    double r = sphere ? spheres.radius(i) : bounds.radius(i - spheres.size());
+
+    for(int a = 0; a < 3; a++) {
+      _lo[a] = any ? min(_lo[a], c[a] - r) : c[a] - r;
+      hi[a]  = any ? max(hi[a],  c[a] + r) : c[a] + r;
+    }
+    any = true;
+  }
+
+  if(!any || cells <= 0) {
+    return;
+  }
+
+  double extent = max(hi[0] - _lo[0], max(hi[1] - _lo[1], hi[2] - _lo[2]));
+  _side   = extent > 0 ? extent / cells : 1;
+  _margin = _side * 1e-3;
+  _per    = 1;
+  for(int a = 0; a < 3; a++) {
+    _n[a] = min(int((hi[a] - _lo[a]) / _side) + 1, cells + 1);
+    _b[a] = (_n[a] + BRICK - 1) / BRICK;
+    _per *= _b[a];
+  }
+
+  _cells = new std::atomic<std::atomic<uint32_t>*>[_per]();
+  _near  = new std::atomic<near_list*>[_per * _lights]();
+}
+
+/**
+ * Frees every brick and list, no shadow ray may be using the cache.
+ */
+shadow_cache::~shadow_cache() {
+  for(int i = 0; i < _per; i++) {
+    delete[] _cells[i].load();
+  }
+  for(int i = 0; i < _per * _lights; i++) {
+    delete _near[i].load();
+  }
+  delete[] _cells;
+  delete[] _near;
+}
+
+/**
+ * Answers a shadow ray from what the cache knows about the cell of the point,
+ * classifying the cell first if it has not been yet.
+ *
+ * @param l the index of the light in the model
+ * @param p the point being shaded
+ * @param s the surface that p is on
+ * @param U the normalized direction of the light from p
+ * @param dist the distance to the light
+ * @return 1 if the light is shadowed, 0 if it is not, -1 if the ray must be traced
+ */
+int shadow_cache::lookup(int l, const point& p, const hit& s, const Vector<3>& U, double dist) {
+  int x = int(std::floor((p[0] - _lo[0]) / _side));
+  int y = int(std::floor((p[1] - _lo[1]) / _side));
+  int z = int(std::floor((p[2] - _lo[2]) / _side));
+
+  if(_cells == NULL || x < 0 || y < 0 || z < 0 || x >= _n[0] || y >= _n[1] || z >= _n[2]) {
+    _traced++;
+    return -1;
+  }
+
+  /* two workers may make the same brick or list, the one that loses throws
+   * its away */
+  int bx = x / BRICK, by = y / BRICK, bz = z / BRICK;
+  int k = (bz * _b[1] + by) * _b[0] + bx;
+  std::atomic<uint32_t>* cells = _cells[k].load(std::memory_order_acquire);
+  if(cells == NULL) {
+    std::atomic<uint32_t>* made = new std::atomic<uint32_t>[BRICK * BRICK * BRICK * _lights]();
+    if(_cells[k].compare_exchange_strong(cells, made, std::memory_order_acq_rel)) {
+      cells = made;
+      _bricks++;
+    } else {
+      delete[] made;
+    }
+  }
+
+  std::atomic<uint32_t>& cell = cells[(((z % BRICK) * BRICK + y % BRICK) * BRICK + x % BRICK) * _lights + l];
+  uint32_t v = cell.load(std::memory_order_relaxed);
+  if(v == 0) {
+    near_list* near = _near[k * _lights + l].load(std::memory_order_acquire);
+    if(near == NULL) {
+      near_list* made = build(l, bx, by, bz);
+      if(_near[k * _lights + l].compare_exchange_strong(near, made, std::memory_order_acq_rel)) {
+        near = made;
+      } else {
+        delete made;
+      }
+    }
+
+    v = classify(l, near, x, y, z);
+    cell.store(v, std::memory_order_relaxed);
+  }
+
+  uint32_t kind = v >> 30, prim = v & 0x3fffffff;
+  uint32_t self = s.type == hit::sphere ? s.index + 1 :
+      s.type == hit::polygon ? _spheres + s.index + 1 : 0;
+
+  if(kind == visible && prim == 0) {
+    _lit++;
+    return 0;
+  }
+
+  /* only the surface itself is near the light, a point inside a sphere can
+   * still be shadowed by the far side of it */
+  if(kind == visible && prim == self) {
+    if(s.type == hit::sphere) {
+      double t = _model->spheres().leaving(s.index, U, p);
+      if(t > 0 && t < dist) {
+        _dark++;
+        return 1;
+      }
+    }
+    _lit++;
+    return 0;
+  }
+
+  /* the ray skips the surface it starts on, so it cannot be the occluder */
+  if(kind == occluded && prim != self) {
+    _dark++;
+    return 1;
+  }
+
+  _traced++;
+  return -1;
+}
+
+/**
+ * Counts an answer of the cache that was checked against the traced ray.
+ *
+ * @param cached what lookup() answered
+ * @param traced what the shadow ray found
+ */
+void shadow_cache::verify(bool cached, bool traced) {
+  _checked++;
+  if(cached != traced) {
+    _wrong++;
+  }
+}
+
+/**
+ * Finds the corners of a box, grown by the margin, and where the shadow rays
+ * from them end. The convex hull of these points holds every shadow ray from
+ * the box, and they are all within the radius of the box of the segment from
+ * its center to where the ray from the center ends.
+ *
+ * @param l the light
+ * @param lo the lowest corner of the box
+ * @param side the length of a side of the box
+ * @param out set to the points, room for 16
+ * @param center set to the center of the box
+ * @param end set to where the shadow ray from the center ends
+ * @return the number of points
+ */
+int shadow_cache::hull(const light& l, const point& lo, double side, point* out,
+    point& center, point& end) const {
+  int n = 0;
+
+  for(int i = 0; i < 8; i++) {
+    point q = lo;
+    for(int a = 0; a < 3; a++) {
+      q[a] += (i >> a) & 1 ? side + _margin : -_margin;
+    }
+    out[n++] = q;
+  }
+
+  center = lo;
+  center += side / 2;
+  end = center + l.direction(center);
+
+  if(l.directional()) {
+    for(int i = 0; i < 8; i++) {
+      out[n++] = out[i] + l.direction(out[i]);
+    }
+  } else {
+    out[n++] = end;
+  }
+
+  return n;
+}
+
+/**
+ * Tests if a primitive could block a shadow ray from a box.
+ *
+ * @param prim the primitive, a sphere or a face
+ * @param c the center of the box
+ * @param e where the shadow ray from c ends
+ * @param radius the distance from c to the corners of the box
+ * @param pts the points from hull()
+ * @param n the number of points
+ * @return false if no shadow ray from the box can touch the primitive
+ */
+bool shadow_cache::touches(uint32_t prim, const point& c, const point& e, double radius,
+    const point* pts, int n) const {
+  if(prim < _spheres) {
+    const sphere_list& spheres = _model->spheres();
+    return segment_distance(spheres.center(prim), c, e) <= spheres.radius(prim) + radius;
+  }
+
+  /* a face cannot block rays that all stay on one side of its plane */
+  const mesh& polys = _model->polygons();
+  uint32_t f = prim - _spheres;
+  const Vector<3>& N = polys.normal(f);
+  const point& A = polys.vertex(polys.tri(polys.first(f)).v[0]);
+  double eps = _margin * N.length();
+  bool above = true, below = true;
+
+  for(int i = 0; i < n && (above || below); i++) {
+    double d = (pts[i] - A).dot(N);
+    above = above && d > eps;
+    below = below && d < -eps;
+  }
+  if(above || below) {
+    return false;
+  }
+
+  return segment_distance(polys.center(f), c, e) <= polys.radius(f) + radius;
+}
+
+/**
+ * Tests if a primitive blocks the shadow ray from every corner of a cell,
+ * grown by the margin. The shadow of a convex primitive is convex, so it then
+ * blocks the ray from every point of the cell.
+ *
+ * @param prim the primitive, a sphere or a face
+ * @param l the light
+ * @param lo the lowest corner of the cell
+ * @param side the length of a side of the cell
+ * @return true if the primitive shadows the whole cell
+ */
+bool shadow_cache::blocks(uint32_t prim, const light& l, const point& lo, double side) const {
+  if(prim >= _spheres && !convex(prim - _spheres)) {
+    return false;
+  }
+
+  for(int i = 0; i < 8; i++) {
+    point q = lo;
+    for(int a = 0; a < 3; a++) {
+      q[a] += (i >> a) & 1 ? side + _margin : -_margin;
+    }
+
+    Vector<3> U = l.direction(q);
+    double t = U.length();
+    if(t == 0) {
+      return false;
+    }
+    U /= t;
+
+    if(prim < _spheres) {
+      if(!_model->spheres().hits(prim, U, q, t)) {
+        return false;
+      }
+    } else {
+      uint32_t f = prim - _spheres;
+      if(_model->polygons().nearest(&f, 1, U, q, -1, t) < 0) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @param face a face of the model
+ * @return true if the polygon the face was made from is convex
+ */
+bool shadow_cache::convex(uint32_t face) const {
+  const mesh& polys = _model->polygons();
+  uint32_t first = polys.first(face), last = polys.last(face);
+  vector<point> v;
+
+  v.push_back(polys.vertex(polys.tri(first).v[0]));
+  for(uint32_t i = first; i < last; i++) {
+    v.push_back(polys.vertex(polys.tri(i).v[1]));
+  }
+  v.push_back(polys.vertex(polys.tri(last - 1).v[2]));
+
+  const Vector<3>& N = polys.normal(face);
+  bool pos = false, neg = false;
+  for(unsigned int i = 0; i < v.size(); i++) {
+    const point& a = v[i];
+    const point& b = v[(i + 1) % v.size()];
+    const point& c = v[(i + 2) % v.size()];
+    double turn = (b - a).cross(c - b).dot(N);
+    pos = pos || turn > 0;
+    neg = neg || turn < 0;
+  }
+
+  return !(pos && neg);
+}
+
+/**
+ * Finds the primitives near the capsule of a brick for a light. A brick that
+ * has too much near it is not worth classifying, all of its cells are mixed.
+ *
+ * @param l the index of the light
+ * @param bx the brick along x
+ * @param by the brick along y
+ * @param bz the brick along z
+ * @return the new list
+ */
+shadow_cache::near_list* shadow_cache::build(int l, int bx, int by, int bz) {
+  long long start = trace::now();
+  const light& lt = _model->lights()[l];
+  const sphere_list& bounds = _model->bounds();
+  double side = BRICK * _side;
+  near_list* ret = new near_list();
+  point pts[16], lo = _lo, c, e;
+
+  ret->crowded = false;
+
+  lo[0] += bx * side;
+  lo[1] += by * side;
+  lo[2] += bz * side;
+  int n = hull(lt, lo, side, pts, c, e);
+  double radius = side * HALF_DIAGONAL + 2 * _margin;
+
+  for(uint32_t i = 0; i < _spheres && ret->prims.size() <= CROWD; i++) {
+    if(touches(i, c, e, radius, pts, n)) {
+      ret->prims.push_back(i);
+    }
+  }
+
+  for(int g = 0; g < bounds.size() && ret->prims.size() <= CROWD; g++) {
+    if(segment_distance(bounds.center(g), c, e) > bounds.radius(g) + radius) {
+      continue;
+    }
+
+    const uint32_t* faces = _model->group(g);
+    for(int i = 0; i < _model->group_size(g); i++) {
+      if(touches(_spheres + faces[i], c, e, radius, pts, n)) {
+        ret->prims.push_back(_spheres + faces[i]);
+      }
+    }
+  }
+
+  if(ret->prims.size() > CROWD) {
+    ret->crowded = true;
+    vector<uint32_t>().swap(ret->prims);
+    _crowded++;
+  }
+
+  _built++;
+  _build += trace::now() - start;
+  return ret;
+}
+
+/**
+ * Works out the state of one cell from the list of its brick.
+ *
+ * @param l the index of the light
+ * @param near what is near the light's capsule of the brick the cell is in
+ * @param x the cell along x
+ * @param y the cell along y
+ * @param z the cell along z
+ * @return the state in the top two bits, below it one more than the primitive
+ */
+uint32_t shadow_cache::classify(int l, const near_list* near, int x, int y, int z) {
+  static thread_local vector<uint32_t> found;
+  long long start = trace::now();
+  const light& lt = _model->lights()[l];
+  point pts[16], lo = _lo, c, e;
+  uint32_t ret = uint32_t(mixed) << 30;
+
+  if(near->crowded) {
+    _states[mixed]++;
+    return ret;
+  }
+
+  lo[0] += x * _side;
+  lo[1] += y * _side;
+  lo[2] += z * _side;
+  int n = hull(lt, lo, _side, pts, c, e);
+  double radius = _side * HALF_DIAGONAL + 2 * _margin;
+
+  found.clear();
+  for(auto iter = near->prims.begin(); iter != near->prims.end(); iter++) {
+    if(touches(*iter, c, e, radius, pts, n)) {
+      found.push_back(*iter);
+    }
+  }
+
+  if(found.size() <= 1) {
+    ret = uint32_t(visible) << 30 | (found.empty() ? 0 : found[0] + 1);
+  }
+  for(auto iter = found.begin(); iter != found.end(); iter++) {
+    if(blocks(*iter, lt, lo, _side)) {
+      ret = uint32_t(occluded) << 30 | (*iter + 1);
+      break;
+    }
+  }
+
+  _states[ret >> 30]++;
+  _build += trace::now() - start;
+  return ret;
+}
+
+/**
+ * Prints what the cache holds and how many shadow rays it answered.
+ */
+void shadow_cache::report() const {
+  unsigned long bytes = _per * (sizeof(*_cells) + _lights * sizeof(*_near)) +
+      _bricks * BRICK * BRICK * BRICK * _lights * sizeof(uint32_t);
+  for(int i = 0; _near != NULL && i < _per * _lights; i++) {
+    const near_list* near = _near[i].load();
+    if(near != NULL) {
+      bytes += sizeof(near_list) + near->prims.capacity() * sizeof(uint32_t);
+    }
+  }
+
+  unsigned long asked = _lit + _dark + _traced;
+  cout << "shadow cache: " << _model->lights().size() << " lights over " << _n[0] << "x" << _n[1]
+       << "x" << _n[2] << " cells, " << _bricks << " bricks, " << _built << " lists ("
+       << _crowded << " crowded), cells "
+       << _states[visible] << " visible, " << _states[occluded] << " occluded, "
+       << _states[mixed] << " mixed; " << asked << " shadow rays, " << _lit << " lit and "
+       << _dark << " shadowed without tracing ("
+       << 100.0 * (_lit + _dark) / max(asked, 1ul) << "%), " << bytes / 1024 << " KiB, built in "
+       << _build / 1e6 << " ms" << endl;
+
+  if(check) {
+    cout << "shadow cache: " << _wrong << " of " << _checked
+         << " answers differ from the traced shadow ray" << endl;
+  }
+}
@@ -0,0 +1,113 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef SHADOW_CACHE_H_INCLUDE
+#define SHADOW_CACHE_H_INCLUDE
+
+#include <surface.h>
+#include <Vector.tpp>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+using std::vector;
+
+class light;
+class model;
+
+/**
+ * What each light can see of the scene, kept on a grid of cubes over the
+ * bounds of the model. A cell is marked:
+ *   1. visible: nothing can be between the light and any point of the cell,
+ *      except perhaps the one primitive that the shaded point lies on.
+ *   2. occluded: a single sphere or convex polygon is between the light and
+ *      every point of the cell.
+ *   3. mixed: anything else, shadow rays from the cell are traced.
+ *
+ * Both tests are conservative: a primitive can only block a shadow ray from a
+ * cell if it touches the capsule around the segments from the cell to the
+ * light, and since the shadow of a convex primitive is convex, a primitive
+ * that blocks the rays from the eight corners of a cell blocks every ray from
+ * the cell. The images are the same as without the cache.
+ *
+ * Nothing is computed until a shadow ray asks. The grid is cut into bricks of
+ * 8x8x8 cells that are only allocated once a point in them is shaded, each
+ * cell keeps the state of every light next to each other since a point is
+ * usually shaded by several lights. The list of primitives near the capsule
+ * of a brick is made the first time a light is asked about a cell of it, and
+ * a cell is classified from that list the first time it is asked for. The
+ * cache belongs to the model so every frame and camera that renders the model
+ * shares it, it is thrown away when the lights change.
+ *
+ * @file shadow_cache.h
+ */
+class shadow_cache {
+  public:
+
+    shadow_cache(const model* m);
+    virtual ~shadow_cache();
+
+    int lookup(int light, const point& p, const hit& s, const Vector<3>& U, double dist);
+    void verify(bool cached, bool traced);
+    void report() const;
+
+    static int  cells;
+    static bool check;
+
+  protected:
+
+    /** what is known about the shadow rays of a cell */
+    enum state { unknown, visible, occluded, mixed };
+
+    static const int BRICK = 8;    ///< cells along each side of a brick
+    static const int CROWD = 1024; ///< most primitives a brick keeps in its list
+
+    /** what is near one light's capsule of a brick */
+    struct near_list {
+      vector<uint32_t> prims;    ///< primitives that touch the capsule of the brick
+      bool             crowded;  ///< too much is near, every cell is mixed
+    };
+
+    near_list* build(int l, int bx, int by, int bz);
+    uint32_t classify(int l, const near_list* near, int x, int y, int z);
+    int hull(const light& l, const point& lo, double side, point* out, point& center, point& end) const;
+    bool touches(uint32_t prim, const point& c, const point& e, double radius, const point* hull, int n) const;
+    bool blocks(uint32_t prim, const light& l, const point& lo, double side) const;
+    bool convex(uint32_t face) const;
+
+    const model*           _model;   ///< the model the cache is for
+    point                  _lo;      ///< the lowest corner of the grid
+    double                 _side;    ///< the length of a side of a cell
+    double                 _margin;  ///< slack for rounding in the tests
+    int                    _n[3];    ///< cells along each axis
+    int                    _b[3];    ///< bricks along each axis
+    int                    _per;     ///< bricks for each light
+    uint32_t               _spheres; ///< primitives below this are spheres, the rest faces
+    int                    _lights;  ///< lights in the model
+
+    /** the cells of each brick, the state of every light of a cell together,
+     * with the state in the top bits and one more than the primitive below */
+    std::atomic<std::atomic<uint32_t>*>* _cells;
+    std::atomic<near_list*>*             _near;  ///< the list of each light in each brick
+
+    std::atomic<unsigned long> _bricks;   ///< bricks allocated
+    std::atomic<unsigned long> _built;    ///< lists made
+    std::atomic<unsigned long> _crowded;  ///< lists that were too crowded
+    std::atomic<unsigned long> _states[4];///< cells classified as each state
+    std::atomic<unsigned long> _lit;      ///< rays answered as not shadowed
+    std::atomic<unsigned long> _dark;     ///< rays answered as shadowed
+    std::atomic<unsigned long> _traced;   ///< rays that had to be traced
+    std::atomic<unsigned long> _checked;  ///< answers compared with the traced ray
+    std::atomic<unsigned long> _wrong;    ///< answers that did not match
+    std::atomic<long long>     _build;    ///< time spent making bricks and cells in ns
+};
+
+#endif /* SHADOW_CACHE_H_INCLUDE */
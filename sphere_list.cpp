@@ -0,0 +1,272 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <sphere_list.h>
+#include <heatmap.h>
+
+#include <cmath>
+#include <limits>
+using std::numeric_limits;
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+/**
+ * Adds a sphere to the end of the list. A new block of padding spheres is
+ * added whenever the list grows past a multiple of the vector width.
+ *
+ * @param center the center of the sphere
+ * @param radius the radius of the sphere
+ */
+void sphere_list::push_back(const point& center, double radius) {
+  unsigned int i = _r.size();
+
+  if(_x.size() == i) {
+    _x.resize(i + WIDTH, 0);
+    _y.resize(i + WIDTH, 0);
+    _z.resize(i + WIDTH, 0);
+    _r2.resize(i + WIDTH, -1);
+  }
+
+  _x[i]  = center[0];
+  _y[i]  = center[1];
+  _z[i]  = center[2];
+  _r2[i] = radius * radius;
+  _r.push_back(radius);
+}
+
+/**
+ * Tests a ray against the sphere it is leaving. A ray leaving the outside of
+ * the sphere cannot hit it again, a ray leaving the inside hits the far side.
+ *
+ * @param i the index of the sphere
+ * @param U the direction of the ray
+ * @param L the origin of the ray, on the sphere
+ * @return the distance to the hit, infinity if there is none
+ */
+double sphere_list::leaving(int i, const Vector<3>& U, const point& L) const {
+  double tx = _x[i] - L[0], ty = _y[i] - L[1], tz = _z[i] - L[2];
+  double out = -(tx*U[0] + ty*U[1] + tz*U[2]);
+  double s, t_sq, m_sq;
+
+  heatmap::intersections++;
+  if(out > 0) {
+    return numeric_limits<double>::infinity();
+  }
+
+  s = tx*U[0] + ty*U[1] + tz*U[2];
+  t_sq = tx*tx + ty*ty + tz*tz;
+  if(s < 0 && t_sq > _r2[i]) {
+    return numeric_limits<double>::infinity();
+  }
+
+  m_sq = t_sq - s*s;
+  if(m_sq > _r2[i]) {
+    return numeric_limits<double>::infinity();
+  }
+
+  if(t_sq > _r2[i] && out >= 0) {
+    return s - sqrt(_r2[i] - m_sq);
+  }
+  return s + sqrt(_r2[i] - m_sq);
+}
+
+/**
+ * Finds the closest sphere that a ray hits. The sphere the ray is leaving must
+ * be tested on its own with leaving() since a ray can hit the inside of it.
+ *
+ * @param U the direction of the ray
+ * @param L the origin of the ray
+ * @param skip the index of the sphere to ignore, -1 to test all of them
+ * @param t the distance to beat, set to the distance to the new hit
+ * @return the index of the sphere that was hit, -1 if none was closer than t
+ */
+int sphere_list::nearest(const Vector<3>& U, const point& L, int skip, double& t) const {
+  int n = _x.size();
+  int best = -1;
+
+  heatmap::intersections += _r.size();
+
+#ifdef __AVX__
+  const __m256d ux = _mm256_set1_pd(U[0]), uy = _mm256_set1_pd(U[1]), uz = _mm256_set1_pd(U[2]);
+  const __m256d lx = _mm256_set1_pd(L[0]), ly = _mm256_set1_pd(L[1]), lz = _mm256_set1_pd(L[2]);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d step = _mm256_set1_pd(WIDTH);
+  const __m256d sk = _mm256_set1_pd(skip);
+  __m256d idx = _mm256_setr_pd(0, 1, 2, 3);
+  __m256d bt  = _mm256_set1_pd(t);
+  __m256d bi  = _mm256_set1_pd(-1);
+
+  for(int i = 0; i < n; i += WIDTH) {
+    __m256d tx = _mm256_sub_pd(_mm256_loadu_pd(&_x[i]), lx);
+    __m256d ty = _mm256_sub_pd(_mm256_loadu_pd(&_y[i]), ly);
+    __m256d tz = _mm256_sub_pd(_mm256_loadu_pd(&_z[i]), lz);
+    __m256d r2 = _mm256_loadu_pd(&_r2[i]);
+
+    __m256d s   = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, ux), _mm256_mul_pd(ty, uy)), _mm256_mul_pd(tz, uz));
+    __m256d tsq = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, tx), _mm256_mul_pd(ty, ty)), _mm256_mul_pd(tz, tz));
+    __m256d msq = _mm256_sub_pd(tsq, _mm256_mul_pd(s, s));
+
+    /* the two rejection tests, the ray starts outside and points away or misses */
+    __m256d outside = _mm256_cmp_pd(tsq, r2, _CMP_GT_OQ);
+    __m256d miss = _mm256_or_pd(
+        _mm256_and_pd(_mm256_cmp_pd(s, zero, _CMP_LT_OQ), outside),
+        _mm256_cmp_pd(msq, r2, _CMP_GT_OQ));
+
+    /* near side of the sphere from the outside, far side from the inside */
+    __m256d q = _mm256_sqrt_pd(_mm256_sub_pd(r2, msq));
+    __m256d d = _mm256_blendv_pd(_mm256_add_pd(s, q), _mm256_sub_pd(s, q), outside);
+
+    __m256d hit = _mm256_and_pd(_mm256_cmp_pd(d, zero, _CMP_GT_OQ), _mm256_cmp_pd(d, bt, _CMP_LT_OQ));
+    hit = _mm256_andnot_pd(miss, _mm256_and_pd(hit, _mm256_cmp_pd(idx, sk, _CMP_NEQ_OQ)));
+
+    bt  = _mm256_blendv_pd(bt, d, hit);
+    bi  = _mm256_blendv_pd(bi, idx, hit);
+    idx = _mm256_add_pd(idx, step);
+  }
+
+  /* reduce the lanes, on a tie the earlier sphere wins like the scalar loop */
+  double lt[WIDTH], li[WIDTH];
+  _mm256_storeu_pd(lt, bt);
+  _mm256_storeu_pd(li, bi);
+  for(int j = 0; j < WIDTH; j++) {
+    if(li[j] >= 0 && (lt[j] < t || (lt[j] == t && int(li[j]) < best))) {
+      t = lt[j];
+      best = int(li[j]);
+    }
+  }
+#else
+  for(int i = 0; i < n; i++) {
+    double tx = _x[i] - L[0], ty = _y[i] - L[1], tz = _z[i] - L[2];
+    double s   = tx*U[0] + ty*U[1] + tz*U[2];
+    double tsq = tx*tx + ty*ty + tz*tz;
+    double msq = tsq - s*s;
+
+    if(i == skip || (s < 0 && tsq > _r2[i]) || msq > _r2[i]) {
+      continue;
+    }
+
+    double q = sqrt(_r2[i] - msq);
+    double d = tsq > _r2[i] ? s - q : s + q;
+    if(d > 0 && d < t) {
+      t = d;
+      best = i;
+    }
+  }
+#endif
+
+  return best;
+}
+
+/**
+ * Finds every sphere that a ray passes through. This is used for spheres that
+ * bound other surfaces, so only the rejection tests are done.
+ *
+ * @param U the direction of the ray
+ * @param L the origin of the ray
+ * @param out the indices of the spheres the ray passes through
+ */
+void sphere_list::candidates(const Vector<3>& U, const point& L, vector<int>& out) const {
+  int n = _x.size();
+
+  out.clear();
+  heatmap::intersections += _r.size();
+
+#ifdef __AVX__
+  const __m256d ux = _mm256_set1_pd(U[0]), uy = _mm256_set1_pd(U[1]), uz = _mm256_set1_pd(U[2]);
+  const __m256d lx = _mm256_set1_pd(L[0]), ly = _mm256_set1_pd(L[1]), lz = _mm256_set1_pd(L[2]);
+  const __m256d zero = _mm256_setzero_pd();
+
+  for(int i = 0; i < n; i += WIDTH) {
+    __m256d tx = _mm256_sub_pd(_mm256_loadu_pd(&_x[i]), lx);
+    __m256d ty = _mm256_sub_pd(_mm256_loadu_pd(&_y[i]), ly);
+    __m256d tz = _mm256_sub_pd(_mm256_loadu_pd(&_z[i]), lz);
+    __m256d r2 = _mm256_loadu_pd(&_r2[i]);
+
+    __m256d s   = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, ux), _mm256_mul_pd(ty, uy)), _mm256_mul_pd(tz, uz));
+    __m256d tsq = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, tx), _mm256_mul_pd(ty, ty)), _mm256_mul_pd(tz, tz));
+    __m256d msq = _mm256_sub_pd(tsq, _mm256_mul_pd(s, s));
+
+    __m256d miss = _mm256_or_pd(
+        _mm256_and_pd(_mm256_cmp_pd(s, zero, _CMP_LT_OQ), _mm256_cmp_pd(tsq, r2, _CMP_GT_OQ)),
+        _mm256_cmp_pd(msq, r2, _CMP_GT_OQ));
+
+    int mask = ~_mm256_movemask_pd(miss) & ((1 << WIDTH) - 1);
+    for(; mask; mask &= mask - 1) {
+      out.push_back(i + __builtin_ctz(mask));
+    }
+  }
+#else
+  for(int i = 0; i < n; i++) {
+    double tx = _x[i] - L[0], ty = _y[i] - L[1], tz = _z[i] - L[2];
+    double s   = tx*U[0] + ty*U[1] + tz*U[2];
+    double tsq = tx*tx + ty*ty + tz*tz;
+
+    if(!(s < 0 && tsq > _r2[i]) && !(tsq - s*s > _r2[i])) {
+      out.push_back(i);
+    }
+  }
+#endif
+}
+
+/**
+ * Tests a ray against one sphere. The arithmetic is the same as in nearest(),
+ * so a ray that hits the sphere gets the same distance to the last bit.
+ *
+ * @param i the index of the sphere
+ * @param U the direction of the ray
+ * @param L the origin of the ray
+ * @param t the distance to beat, set to the distance to the hit
+ * @return true if the sphere was hit closer than t
+ */
+bool sphere_list::hits(int i, const Vector<3>& U, const point& L, double& t) const {
+  double tx = _x[i] - L[0], ty = _y[i] - L[1], tz = _z[i] - L[2];
+  double s   = tx*U[0] + ty*U[1] + tz*U[2];
+  double tsq = tx*tx + ty*ty + tz*tz;
+  double msq = tsq - s*s;
+
+  if((s < 0 && tsq > _r2[i]) || msq > _r2[i]) {
+    return false;
+  }
+
+  double q = sqrt(_r2[i] - msq);
+  double d = tsq > _r2[i] ? s - q : s + q;
+  if(d > 0 && d < t) {
+    t = d;
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * Tests if a ray passes through one sphere, the same test as candidates().
+ *
+ * @param i the index of the sphere
+ * @param U the direction of the ray
+ * @param L the origin of the ray
+ * @return true if candidates() would list the sphere
+ */
+bool sphere_list::passes(int i, const Vector<3>& U, const point& L) const {
+  double tx = _x[i] - L[0], ty = _y[i] - L[1], tz = _z[i] - L[2];
+  double s   = tx*U[0] + ty*U[1] + tz*U[2];
+  double tsq = tx*tx + ty*ty + tz*tz;
+
+  return !(s < 0 && tsq > _r2[i]) && !(tsq - s*s > _r2[i]);
+}
+
+/**
+ * @return the number of bytes used by the list, padding included
+ */
+unsigned long sphere_list::bytes() const {
+  return (_x.capacity() + _y.capacity() + _z.capacity() + _r2.capacity() + _r.capacity()) * sizeof(double);
+}
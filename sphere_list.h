@@ -0,0 +1,63 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef SPHERE_LIST_H_INCLUDE
+#define SPHERE_LIST_H_INCLUDE
+
+#include <surface.h>
+#include <Vector.tpp>
+
+#include <vector>
+using std::vector;
+
+/**
+ * A list of spheres stored as a structure of arrays, the x, y and z of the
+ * centers and the squared radii each in their own array. This lets a ray be
+ * tested against several spheres at once. When compiled with AVX four spheres
+ * are tested per instruction, otherwise the same loop is run one sphere at a
+ * time.
+ *
+ * The arrays are padded to a multiple of the vector width with spheres that
+ * can never be hit.
+ *
+ * @file sphere_list.h
+ */
+class sphere_list {
+  public:
+
+    sphere_list() : _x(), _y(), _z(), _r2(), _r() { }
+    virtual ~sphere_list() { }
+
+    void push_back(const point& center, double radius);
+
+    int nearest(const Vector<3>& U, const point& L, int skip, double& t) const;
+    double leaving(int i, const Vector<3>& U, const point& L) const;
+    void candidates(const Vector<3>& U, const point& L, vector<int>& out) const;
+    bool hits(int i, const Vector<3>& U, const point& L, double& t) const;
+    bool passes(int i, const Vector<3>& U, const point& L) const;
+
+    inline int size() const { return _r.size(); }
+    inline point center(int i) const { point c; c[0] = _x[i]; c[1] = _y[i]; c[2] = _z[i]; return c; }
+    inline double radius(int i) const { return _r[i]; }
+    unsigned long bytes() const;
+
+    static const int WIDTH = 4;
+
+  protected:
+
+    vector<double> _x;   ///< x coordinate of each center
+    vector<double> _y;   ///< y coordinate of each center
+    vector<double> _z;   ///< z coordinate of each center
+    vector<double> _r2;  ///< squared radius of each sphere
+    vector<double> _r;   ///< radius of each sphere, not padded
+};
+
+#endif /* SPHERE_LIST_H_INCLUDE */
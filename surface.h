@@ -17,6 +17,7 @@
 #include <lexer.h>
 
 /* std library includes */
+#include <cstdint>
 #include <iostream>
 using std::ostream;
 #include <string>
@@ -27,97 +28,27 @@ using std::get;
 #include <vector>
 using std::vector;
 
-class surface {
-  public:
-    surface() : _id(id_gen++) { };
-    virtual ~surface() { };
-
-    virtual Vector<3> normal(const Vector<3>& v) const = 0;
-    virtual tuple<point, double, const surface*> intersection(const Vector<3>& U, const point& L, const surface* skip) const = 0;
-    virtual point center() const = 0;
-    virtual double radius() const = 0;
-
-    inline string& material() { return _material; }
-    inline string material() const { return _material; }
-    inline int id() const { return _id; }
-    inline bool& src() { return _src; }
-    inline bool src() const { return _src; }
-
-  protected:
-
-    string _material;
-    int _id;
-    bool _src;
-
-    static int id_gen;
-};
-
-class sphere : public surface {
-  public:
-
-    typedef vector<surface*>::iterator iterator;
-    typedef vector<surface*>::const_iterator const_iterator;
-
-    sphere() { }
-    sphere(const point& _center, double _radius) : _center(_center), _radius(_radius) { }
-    virtual ~sphere() { for(auto iter = _subsurfaces.begin(); iter != _subsurfaces.end(); iter++) delete *iter; }
-
-    inline point& center() { return _center; }
-    inline double& radius() { return _radius; }
-    inline unsigned int size() { return _subsurfaces.size(); }
-    inline void clear() { _subsurfaces.clear(); }
-    inline void push_back(surface* s) { _subsurfaces.push_back(s); }
-    inline void insert(const iterator& pos, surface* s) { _subsurfaces.insert(pos, s); }
-    inline void insert(const iterator& s, const iterator& e) { _subsurfaces.insert(end(), s, e); }
-    bool close(const sphere& oth) const;
-
-    inline iterator begin() { return _subsurfaces.begin(); }
-    inline const_iterator begin() const { return _subsurfaces.begin(); }
-    inline iterator end() { return _subsurfaces.end(); }
-    inline const_iterator end() const { return _subsurfaces.end(); }
-
-    virtual inline Vector<3> normal(const Vector<3>& v) const { return v - _center; }
-    virtual tuple<point, double, const surface*> intersection(const Vector<3>& ray, const point& src, const surface* skip) const;
-    virtual inline point center() const { return _center; }
-    virtual inline double radius() const { return _radius; }
-
-  protected:
-
-    point            _center;       ///< the index of the center of the sphere within a shape
-    double           _radius;       ///< the radius of the sphere
-    vector<surface*> _subsurfaces;  ///< list of surfaces that are contained within this sphere
-};
-
-class polygon : public surface {
-  public:
-
-    typedef vector<point>::iterator iterator;
-    typedef vector<point>::const_iterator const_iterator;
-
-    polygon() : _vertices() { }
-    virtual ~polygon() { }
-
-    inline void add_vertex(Vector<3> v) { _vertices.push_back(v); }
-    inline int size() const { return _vertices.size(); }
-    inline Vector<3>& normal() { return _n; }
-    inline string& material() { return _material; }
-    inline string material() const { return _material; }
-    inline iterator begin() { return _vertices.begin(); }
-    inline const_iterator begin() const { return _vertices.begin(); }
-    inline iterator end() { return _vertices.end(); }
-    inline const_iterator end() const { return _vertices.end(); }
-    inline point& operator[](int i) { return _vertices[i]; }
-    inline point operator[](int i) const { return _vertices[i]; }
-
-    virtual inline Vector<3> normal(const Vector<3>& v) const { if(v == v) return _n; return _n; }
-    virtual tuple<point, double, const surface*> intersection(const Vector<3>& U, const point& L, const surface* skip) const;
-    virtual point center() const;
-    virtual double radius() const;
-
-  protected:
-
-    vector<point>             _vertices;  ///< the verticies that represent this polygon
-    Vector<3>                 _n;         ///< TODO
+/**
+ * The result of testing a ray against a model. Primitives are stored by the
+ * model in one array per type, a hit is the type of the primitive and its
+ * index in that array. This is plain data so that it is cheap to return and
+ * copy. Only the distance is kept, the point of the hit is calculated with
+ * at() once the closest hit is known.
+ *
+ * A hit is also used to name the primitive that a ray is leaving.
+ */
+struct hit {
+  /** the arrays that index can refer to */
+  enum kind { none, sphere, polygon };
+
+  double   t;      ///< distance along the ray to the hit
+  int      type;   ///< the kind of primitive that was hit
+  uint32_t index;  ///< the index of the primitive in the array for its kind
+
+  inline point at(const Vector<3>& U, const point& L) const { return L + t*U; }
+  inline bool is(int k, uint32_t i) const { return type == k && index == i; }
+
+  static inline hit miss(double t) { hit h = { t, none, 0 }; return h; }
 };
 
 class pre_sphere {
@@ -164,10 +95,6 @@ class pre_polygon {
     string _material;
 };
 
-inline bool operator==(const sphere& lhs, const sphere& rhs) {
-  return lhs.center() == rhs.center() && lhs.radius() == rhs.radius();
-}
-
 lexer& operator>>(lexer& istr, pre_polygon& poly);
 lexer& operator>>(lexer& istr, pre_sphere& sphere);
 
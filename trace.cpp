@@ -0,0 +1,149 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#include <trace.h>
+
+#include <chrono>
+#include <fstream>
+using std::ofstream;
+#include <iomanip>
+using std::setfill;
+using std::setw;
+#include <iostream>
+using std::cerr;
+using std::endl;
+#include <mutex>
+#include <sstream>
+using std::ostringstream;
+
+/* intialize statics */
+bool trace::enabled = false;
+
+/* every buffer ever created, only touched when a thread records its first event */
+static vector<trace_buffer*>                 buffers;
+static std::mutex                            buffers_lock;
+static thread_local trace_buffer*            buffer = NULL;
+static thread_local string                   buffer_name;
+static std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+trace_buffer::~trace_buffer() {
+  for(auto iter = _blocks.begin(); iter != _blocks.end(); iter++) {
+    delete[] *iter;
+  }
+}
+
+/**
+ * Adds an event to the end of the buffer. This should only ever be called by
+ * the thread that owns the buffer.
+ *
+ * @param e the event to add
+ */
+void trace_buffer::push(const trace_event& e) {
+  if(_used == BLOCK_SIZE) {
+    _blocks.push_back(new trace_event[BLOCK_SIZE]);
+    _used = 0;
+  }
+
+  _blocks.back()[_used++] = e;
+}
+
+/**
+ * Sets the name that the calling thread will be displayed with. This must be
+ * called before the thread records its first event.
+ *
+ * @param name the name of the thread
+ */
+void trace::thread_name(const string& name) {
+  buffer_name = name;
+}
+
+/**
+ * @return the number of nanoseconds since the trace epoch
+ */
+long long trace::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - epoch).count();
+}
+
+/**
+ * Records a span that started at start and ends now.
+ *
+ * @param name the name of the span, this must be a string literal
+ * @param start the time the span started, as returned by now()
+ * @param arg extra information that is displayed with the span
+ */
+void trace::record(const char* name, long long start, int arg) {
+  trace_event e = { name, start, now() - start, arg };
+  local()->push(e);
+}
+
+/**
+ * Gets the buffer for the calling thread, creating it if this is the first
+ * event the thread has recorded.
+ *
+ * @return the buffer that belongs to the calling thread
+ */
+trace_buffer* trace::local() {
+  if(buffer == NULL) {
+    std::unique_lock<std::mutex> ul(buffers_lock);
+    ostringstream name;
+
+    if(buffer_name.empty()) {
+      name << "thread " << buffers.size();
+    } else {
+      name << buffer_name;
+    }
+
+    buffer = new trace_buffer(buffers.size() + 1, name.str());
+    buffers.push_back(buffer);
+  }
+
+  return buffer;
+}
+
+/**
+ * Writes every recorded event to a file as Chrome trace-event JSON. This must
+ * only be called while no other thread is recording.
+ *
+ * @param filename the name of the file to write to
+ * @return true if the file was written
+ */
+bool trace::write(const string& filename) {
+  std::unique_lock<std::mutex> ul(buffers_lock);
+  ofstream ostr(filename.c_str());
+  bool first = true;
+
+  if(!ostr) {
+    cerr << "ERROR: could not open trace file: " << filename << endl;
+    return false;
+  }
+
+  ostr << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  for(auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+    trace_buffer* b = *iter;
+
+    ostr << (first ? "" : ",\n")
+         << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid()
+         << ",\"args\":{\"name\":\"" << b->name() << "\"}}";
+    first = false;
+
+    for(unsigned int i = 0; i < b->size(); i++) {
+      const trace_event& e = (*b)[i];
+      ostr << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid()
+           << ",\"ts\":" << e.start / 1000 << "." << setw(3) << setfill('0') << e.start % 1000
+           << ",\"dur\":" << e.dur / 1000 << "." << setw(3) << setfill('0') << e.dur % 1000
+           << ",\"args\":{\"arg\":" << e.arg << "}}";
+    }
+  }
+  ostr << "\n]}\n";
+
+  return bool(ostr);
+}
@@ -0,0 +1,101 @@
+/* ****************************************************************************
+ * Copyright (C) 2010 Alex Norton                                             *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or modify it    *
+ * under the terms of the BSD 2-Clause License.                               *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful, but        *
+ * WITHOUT ANY WARRENTY; without even the implied warranty of                 *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                       *
+ **************************************************************************** */
+
+#ifndef TRACE_H_INCLUDE
+#define TRACE_H_INCLUDE
+
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+
+/**
+ * A single span on the timeline. Names must be string literals, the tracer
+ * only keeps the pointer.
+ */
+struct trace_event {
+  const char* name;   ///< what the thread was doing
+  long long   start;  ///< nanoseconds since the trace epoch
+  long long   dur;    ///< length of the span in nanoseconds
+  int         arg;    ///< extra information, the depth of a bounce for example
+};
+
+/**
+ * The events recorded by a single thread. Only the owning thread ever writes
+ * into a buffer so recording an event never takes a lock. Events are stored in
+ * fixed size blocks so that a full buffer never has to be copied while the
+ * thread is running.
+ */
+class trace_buffer {
+  public:
+
+    trace_buffer(int tid, const string& name) :
+      _blocks(), _used(BLOCK_SIZE), _tid(tid), _name(name) { }
+    virtual ~trace_buffer();
+
+    void push(const trace_event& e);
+
+    inline int tid() const { return _tid; }
+    inline string name() const { return _name; }
+    inline unsigned int size() const { return _blocks.size() * BLOCK_SIZE - (BLOCK_SIZE - _used); }
+    inline const trace_event& operator[](int i) const { return _blocks[i / BLOCK_SIZE][i % BLOCK_SIZE]; }
+
+    static const int BLOCK_SIZE = 1 << 16;
+
+  protected:
+
+    vector<trace_event*> _blocks; ///< the storage for the events
+    int                  _used;   ///< number of events in the last block
+    int                  _tid;    ///< the id of the thread on the timeline
+    string               _name;   ///< the name displayed for the thread
+};
+
+/**
+ * Records a timeline of what every thread is doing while an image is rendered.
+ * The timeline is written as Chrome trace-event JSON, which can be opened in
+ * chrome://tracing or Perfetto. Tracing is turned off by default, when it is
+ * off the only cost is checking the enabled flag.
+ *
+ * @file trace.h
+ */
+class trace {
+  public:
+
+    static void thread_name(const string& name);
+    static long long now();
+    static void record(const char* name, long long start, int arg = 0);
+    static bool write(const string& filename);
+
+    static bool enabled;
+
+  protected:
+
+    static trace_buffer* local();
+};
+
+/**
+ * Records a span that lasts for the lifetime of the object.
+ */
+class trace_span {
+  public:
+
+    trace_span(const char* name, int arg = 0) :
+      _name(name), _arg(arg), _start(trace::enabled ? trace::now() : 0) { }
+    ~trace_span() { if(trace::enabled) trace::record(_name, _start, _arg); }
+
+  protected:
+
+    const char* _name;
+    int         _arg;
+    long long   _start;
+};
+
+#endif /* TRACE_H_INCLUDE */